@@ -8,7 +8,11 @@ ls /proc/pmu_stats /proc/pmu_control
 rm -rf bin
 mkdir bin
 
-gcc -O0 ./src/part4_random_access.c -o ./bin/random_access_phases
-gcc -O0 ./src/part4_matrix.c -o ./bin/matrix_phases
+gcc -O2 ./src/part4_random_access.c ./src/bench_alloc.c ./src/libpmu.c -o ./bin/random_access_phases
+gcc -O2 ./src/part4_matrix.c ./src/bench_alloc.c ./src/libpmu.c -o ./bin/matrix_phases -lm -lpthread
+gcc -O2 -fopenmp ./src/part4_matrix_omp.c ./src/pmu_region.c ./src/libpmu.c -o ./bin/matrix_omp
+gcc -O2 ./src/pmu_top.c ./src/libpmu.c -o ./bin/pmu_top
+gcc -O2 ./src/pmu_stream.c ./src/libpmu.c -o ./bin/pmu_stream
+gcc -O2 -Wall ./src/pmu_sim_test.c -o ./bin/pmu_sim_test && ./bin/pmu_sim_test || exit 1
 
 python3 ./src/part4.py
\ No newline at end of file
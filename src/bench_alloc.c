@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bench_alloc.h"
+
+static const char *const policy_names[] = {
+    [BENCH_ALLOC_MALLOC]   = "malloc",
+    [BENCH_ALLOC_THP]      = "thp",
+    [BENCH_ALLOC_HUGETLB]  = "hugetlb",
+    [BENCH_ALLOC_POPULATE] = "populate",
+};
+
+#define NR_POLICIES (int)(sizeof(policy_names) / sizeof(policy_names[0]))
+
+int bench_alloc_parse(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NR_POLICIES; i++) {
+        if (!strcmp(policy_names[i], name))
+            return i;
+    }
+    return -1;
+}
+
+const char *bench_alloc_name(int policy)
+{
+    if (policy < 0 || policy >= NR_POLICIES)
+        return "?";
+    return policy_names[policy];
+}
+
+const char *bench_alloc_names(void)
+{
+    return "malloc|thp|hugetlb|populate";
+}
+
+static size_t map_length(size_t bytes)
+{
+    return (bytes + BENCH_HUGE_PAGE - 1) & ~(BENCH_HUGE_PAGE - 1);
+}
+
+/*
+ * The kernel only backs 2 MB-aligned ranges with huge pages, so map one
+ * huge page more and unmap the unaligned head and tail.
+ */
+static void *thp_alloc(size_t len)
+{
+    char *map, *p;
+    size_t head;
+
+    map = mmap(NULL, len + BENCH_HUGE_PAGE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    p = (char *)(((uintptr_t)map + BENCH_HUGE_PAGE - 1) & ~(BENCH_HUGE_PAGE - 1));
+    head = p - map;
+    if (head)
+        munmap(map, head);
+    munmap(p + len, BENCH_HUGE_PAGE - head);
+
+    /* before the first touch, so the faults can take whole huge pages */
+    if (madvise(p, len, MADV_HUGEPAGE) < 0)
+        perror("madvise(MADV_HUGEPAGE)");
+    return p;
+}
+
+void *bench_alloc(size_t bytes, int policy)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    size_t len = map_length(bytes);
+    void *p;
+
+    switch (policy) {
+    case BENCH_ALLOC_MALLOC:
+        if ((errno = posix_memalign(&p, BENCH_ALLOC_ALIGN, bytes)))
+            return NULL;
+        return p;
+    case BENCH_ALLOC_HUGETLB:  flags |= MAP_HUGETLB; break;
+    case BENCH_ALLOC_POPULATE: flags |= MAP_POPULATE; break;
+    case BENCH_ALLOC_THP:      break;
+    default:
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (policy == BENCH_ALLOC_THP)
+        return thp_alloc(len);
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void bench_free(void *p, size_t bytes, int policy)
+{
+    if (!p)
+        return;
+    if (policy == BENCH_ALLOC_MALLOC)
+        free(p);
+    else
+        munmap(p, map_length(bytes));
+}
+
+/*
+ * The module's event set is machine-wide, so a run killed by a signal
+ * must not leave everyone on the TLB set. The handler only issues the
+ * SET_EVENTS ioctl, then lets the signal do what it would have done.
+ */
+static const int restore_signals[] = {
+    SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGSEGV, SIGBUS, SIGFPE, SIGABRT,
+};
+
+#define NR_RESTORE_SIGNALS (int)(sizeof(restore_signals) / sizeof(restore_signals[0]))
+
+static struct pmu *restore_pmu;
+static struct pmu_event_config restore_config;
+static struct sigaction restore_old[NR_RESTORE_SIGNALS];
+
+static void restore_on_signal(int sig)
+{
+    pmu_set_events(restore_pmu, restore_config.event, restore_config.nr_events);
+    /* SA_RESETHAND put the default action back, so this ends the run */
+    raise(sig);
+}
+
+static void restore_handlers(void)
+{
+    int i;
+
+    for (i = 0; i < NR_RESTORE_SIGNALS; i++)
+        sigaction(restore_signals[i], &restore_old[i], NULL);
+    restore_pmu = NULL;
+}
+
+int bench_tlb_events(struct pmu *pmu, struct pmu_event_config *saved)
+{
+    static const __u32 events[] = {
+        EVT_INSTR_RETIRED, EVT_L1D_ACCESS, EVT_L1D_REFILL, EVT_LLC_REFILL,
+        EVT_L1D_TLB_REFILL, EVT_L2D_TLB_REFILL,
+    };
+    struct pmu_snapshot snap;
+    struct sigaction sa;
+    int i;
+
+    if (pmu_snapshot(pmu, &snap) < 0)
+        return -1;
+    *saved = snap.config;
+
+    /* perf events belong to this process and go away with it */
+    if (!strcmp(pmu_backend_name(pmu), "module")) {
+        restore_pmu = pmu;
+        restore_config = *saved;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = restore_on_signal;
+        sa.sa_flags = SA_RESETHAND;
+        sigemptyset(&sa.sa_mask);
+        for (i = 0; i < NR_RESTORE_SIGNALS; i++)
+            sigaction(restore_signals[i], &sa, &restore_old[i]);
+    }
+
+    if (pmu_set_events(pmu, events, sizeof(events) / sizeof(events[0])) < 0) {
+        if (restore_pmu)
+            restore_handlers();
+        return -1;
+    }
+    return 0;
+}
+
+int bench_restore_events(struct pmu *pmu, const struct pmu_event_config *saved)
+{
+    if (restore_pmu)
+        restore_handlers();
+    return pmu_set_events(pmu, saved->event, saved->nr_events);
+}
@@ -0,0 +1,54 @@
+#ifndef BENCH_ALLOC_H
+#define BENCH_ALLOC_H
+
+#include <stddef.h>
+
+#include "libpmu.h"
+
+/*
+ * Benchmark buffers under one allocation policy, picked with -a:
+ *
+ *   malloc    posix_memalign, what the benchmarks always did
+ *   thp       2 MB-aligned anonymous mmap + MADV_HUGEPAGE (transparent
+ *             huge pages)
+ *   hugetlb   mmap with MAP_HUGETLB from the hugetlbfs pool, reserve it
+ *             first: echo 256 | sudo tee /proc/sys/vm/nr_hugepages
+ *   populate  anonymous mmap with MAP_POPULATE, 4K pages faulted in up front
+ *
+ * Every buffer is at least BENCH_ALLOC_ALIGN aligned. The mmap policies
+ * round the length up to BENCH_HUGE_PAGE; bench_free() rounds the same way.
+ */
+
+#define BENCH_ALLOC_ALIGN 64
+#define BENCH_HUGE_PAGE   (2UL * 1024 * 1024)
+
+enum bench_alloc_policy {
+    BENCH_ALLOC_MALLOC,
+    BENCH_ALLOC_THP,
+    BENCH_ALLOC_HUGETLB,
+    BENCH_ALLOC_POPULATE,
+};
+
+/* -1 for an unknown name */
+int bench_alloc_parse(const char *name);
+const char *bench_alloc_name(int policy);
+/* "malloc|thp|hugetlb|populate" for usage text */
+const char *bench_alloc_names(void);
+
+/* NULL with errno set */
+void *bench_alloc(size_t bytes, int policy);
+void bench_free(void *p, size_t bytes, int policy);
+
+/*
+ * The event set of every -a run, whatever the policy, so malloc is the
+ * baseline of the others: the default six without the two L1I events, plus
+ * L1D_TLB_REFILL and L2D_TLB_REFILL. Six events fit the A72's counters, so
+ * nothing is multiplexed. The current events are saved in *saved for
+ * bench_restore_events(). With the module the set is machine-wide and
+ * needs CAP_PERFMON; until bench_restore_events() a fatal signal restores
+ * it too. 0, or -1 on error.
+ */
+int bench_tlb_events(struct pmu *pmu, struct pmu_event_config *saved);
+int bench_restore_events(struct pmu *pmu, const struct pmu_event_config *saved);
+
+#endif /* BENCH_ALLOC_H */
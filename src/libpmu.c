@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "libpmu.h"
+
+enum pmu_backend {
+    PMU_BACKEND_MODULE,
+    PMU_BACKEND_PERF,
+};
+
+/*
+ * Upper bound on the events of one perf group, the A72's six counters.
+ * Hosts with fewer counters reject a member that no longer fits, and the
+ * event then starts a new group, so groups end up sized to the host.
+ */
+#define PERF_GROUP_MAX 6
+
+struct perf_group {
+    int leader;
+    int has_cycles;
+    unsigned int nr;
+    unsigned int idx[PERF_GROUP_MAX];   /* member k counts config.event[idx[k]] */
+    __u64 base_enabled;
+    __u64 base_running;
+};
+
+struct pmu {
+    enum pmu_backend backend;
+    int fd;
+    unsigned int ring_pages;
+    unsigned int nr_rings;
+    /* perf backend */
+    struct pmu_event_config config;
+    int pid;                /* 0 is the calling process */
+    int running;
+    int fds[PMU_MAX_EVENTS + 1];
+    unsigned int nr_fds;
+    struct perf_group groups[PMU_MAX_EVENTS + 1];
+    unsigned int nr_groups;
+};
+
+struct pmu_ring {
+    struct pmu_ring_header *hdr;
+    struct pmu_sample *data;
+    size_t len;
+    __u32 nr;
+};
+
+/*
+ * perf_event_open backend. The configured events are opened as counting
+ * groups on the target process (inherited by its threads and children),
+ * cycles leading the first group, so one read() per group returns every
+ * count together with its enabled/running times. Groups beyond the
+ * hardware counters are multiplexed by perf and scaled here like the
+ * module does. Events this host cannot count are left out and read as
+ * not counted (pmu_counted() is 0) instead of failing the open. There is
+ * no per-cpu split, no sampling and no interval mode in this backend.
+ */
+#define PERF_CACHE(cache, result) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+static int perf_attr_for(__u32 event, struct perf_event_attr *attr)
+{
+#ifndef __aarch64__
+    static const struct {
+        __u32 code;
+        __u32 type;
+        __u64 config;
+    } generic[] = {
+        { EVT_CPU_CYCLES,     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { EVT_INSTR_RETIRED,  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { EVT_BR_RETIRED,     PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+        { EVT_BR_MIS_PRED,    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { EVT_STALL_FRONTEND, PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND },
+        { EVT_STALL_BACKEND,  PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND },
+        { EVT_L1I_ACCESS,     PERF_TYPE_HW_CACHE,
+          PERF_CACHE(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_RESULT_ACCESS) },
+        { EVT_L1I_REFILL,     PERF_TYPE_HW_CACHE,
+          PERF_CACHE(PERF_COUNT_HW_CACHE_L1I, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+        { EVT_L1D_ACCESS,     PERF_TYPE_HW_CACHE,
+          PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_ACCESS) },
+        { EVT_L1D_REFILL,     PERF_TYPE_HW_CACHE,
+          PERF_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+        { EVT_LLC_REFILL,     PERF_TYPE_HW_CACHE,
+          PERF_CACHE(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+        { EVT_L1D_TLB_REFILL, PERF_TYPE_HW_CACHE,
+          PERF_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+        { EVT_L1I_TLB_REFILL, PERF_TYPE_HW_CACHE,
+          PERF_CACHE(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    };
+    unsigned int i;
+#endif
+
+    memset(attr, 0, sizeof(*attr));
+    attr->size = sizeof(*attr);
+    attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                        PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr->inherit = 1;
+    attr->exclude_hv = 1;
+
+#ifdef __aarch64__
+    /* armv8_pmu takes the architectural event numbers as raw events */
+    attr->type = PERF_TYPE_RAW;
+    attr->config = event;
+    return 0;
+#else
+    /* elsewhere only the events with a generic perf equivalent */
+    for (i = 0; i < sizeof(generic) / sizeof(generic[0]); i++) {
+        if (generic[i].code == event) {
+            attr->type = generic[i].type;
+            attr->config = generic[i].config;
+            return 0;
+        }
+    }
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+/* the host has no such event, as opposed to a real error such as EACCES */
+static int perf_missing(int err)
+{
+    return err == ENOENT || err == EOPNOTSUPP || err == ENODEV ||
+           err == EINVAL;
+}
+
+static int perf_open_one(struct pmu *pmu, __u32 event, int group_fd)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    if (perf_attr_for(event, &attr) < 0)
+        return -1;
+    /* members follow their leader, only leaders get enabled */
+    attr.disabled = group_fd < 0;
+
+    fd = syscall(SYS_perf_event_open, &attr, pmu->pid, -1, group_fd,
+                 PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    pmu->fds[pmu->nr_fds++] = fd;
+    return fd;
+}
+
+static void perf_close_events(struct pmu *pmu)
+{
+    unsigned int i;
+
+    for (i = 0; i < pmu->nr_fds; i++)
+        close(pmu->fds[i]);
+    pmu->nr_fds = 0;
+    pmu->nr_groups = 0;
+    pmu->running = 0;
+}
+
+/* once per event and process, a pmu is reopened on every retarget */
+static void perf_warn_missing(__u32 event)
+{
+    static __u32 warned[PMU_MAX_EVENTS + 1];
+    static unsigned int nr_warned;
+    const char *name = pmu_event_name(event);
+    unsigned int i;
+
+    for (i = 0; i < nr_warned; i++) {
+        if (warned[i] == event)
+            return;
+    }
+    if (nr_warned < sizeof(warned) / sizeof(warned[0]))
+        warned[nr_warned++] = event;
+
+    if (name)
+        fprintf(stderr, "libpmu: perf cannot count %s here, it reads as n/a\n",
+                name);
+    else
+        fprintf(stderr, "libpmu: perf cannot count event 0x%02x here, "
+                "it reads as n/a\n", event);
+}
+
+/*
+ * Cycles lead the first group. Every event joins the last group; when the
+ * host rejects it there (no counter left for the group), it leads a new
+ * one, and when it cannot be opened even alone it is missing.
+ */
+static int perf_open_events(struct pmu *pmu)
+{
+    struct perf_group *g = NULL;
+    unsigned int i;
+    int fd;
+
+    perf_close_events(pmu);
+
+    fd = perf_open_one(pmu, EVT_CPU_CYCLES, -1);
+    if (fd >= 0) {
+        g = &pmu->groups[pmu->nr_groups++];
+        memset(g, 0, sizeof(*g));
+        g->leader = fd;
+        g->has_cycles = 1;
+    } else if (!perf_missing(errno)) {
+        goto err;
+    } else {
+        perf_warn_missing(EVT_CPU_CYCLES);
+    }
+
+    for (i = 0; i < pmu->config.nr_events; i++) {
+        if (g && g->nr < PERF_GROUP_MAX) {
+            fd = perf_open_one(pmu, pmu->config.event[i], g->leader);
+            if (fd >= 0) {
+                g->idx[g->nr++] = i;
+                continue;
+            }
+            if (!perf_missing(errno) && errno != ENOSPC)
+                goto err;
+        }
+
+        fd = perf_open_one(pmu, pmu->config.event[i], -1);
+        if (fd < 0) {
+            if (!perf_missing(errno))
+                goto err;
+            perf_warn_missing(pmu->config.event[i]);
+            continue;
+        }
+        g = &pmu->groups[pmu->nr_groups++];
+        memset(g, 0, sizeof(*g));
+        g->leader = fd;
+        g->idx[g->nr++] = i;
+    }
+
+    if (!pmu->nr_groups) {
+        errno = ENOENT;
+        return -1;
+    }
+    return 0;
+
+err:
+    fd = errno;
+    perf_close_events(pmu);
+    errno = fd;
+    return -1;
+}
+
+struct perf_group_read {
+    __u64 nr;
+    __u64 time_enabled;
+    __u64 time_running;
+    __u64 values[PERF_GROUP_MAX + 1];
+};
+
+static int perf_read_group(const struct perf_group *g, struct perf_group_read *r)
+{
+    if (read(g->leader, r, sizeof(*r)) < 0)
+        return -1;
+    r->time_enabled -= g->base_enabled;
+    r->time_running -= g->base_running;
+    return 0;
+}
+
+static __u64 perf_scale(__u64 count, __u64 enabled, __u64 running)
+{
+    if (!running)
+        return 0;
+    if (running >= enabled)
+        return count;
+    return (__u64)((double)count * enabled / running);
+}
+
+static int perf_snapshot(struct pmu *pmu, struct pmu_snapshot *snap)
+{
+    struct pmu_counts *total = &snap->total;
+    struct perf_group_read r;
+    struct perf_group *g;
+    unsigned int i, k;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->state = pmu->running;
+    snap->config = pmu->config;
+    snap->target.pid = pmu->pid;
+    snap->target.flags = PMU_TARGET_CHILDREN;
+
+    /* missing events keep 0 and time_running 0 */
+    for (i = 0; i < pmu->nr_groups; i++) {
+        g = &pmu->groups[i];
+        if (perf_read_group(g, &r) < 0)
+            return -1;
+
+        if (r.time_enabled > total->time_enabled)
+            total->time_enabled = r.time_enabled;
+        if (g->has_cycles)
+            total->cycles = perf_scale(r.values[0], r.time_enabled,
+                                       r.time_running);
+        for (k = 0; k < g->nr && k + g->has_cycles < r.nr; k++) {
+            total->event[g->idx[k]] =
+                perf_scale(r.values[k + g->has_cycles], r.time_enabled,
+                           r.time_running);
+            total->time_running[g->idx[k]] = r.time_running;
+        }
+    }
+    return 0;
+}
+
+static int perf_ioctl_groups(struct pmu *pmu, unsigned long req)
+{
+    unsigned int i;
+
+    for (i = 0; i < pmu->nr_groups; i++) {
+        if (ioctl(pmu->groups[i].leader, req, PERF_IOC_FLAG_GROUP) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* RESET clears the counts but not the times, so remember where they were */
+static int perf_start(struct pmu *pmu)
+{
+    struct perf_group_read r;
+    unsigned int i;
+
+    if (perf_ioctl_groups(pmu, PERF_EVENT_IOC_DISABLE) < 0 ||
+        perf_ioctl_groups(pmu, PERF_EVENT_IOC_RESET) < 0)
+        return -1;
+
+    for (i = 0; i < pmu->nr_groups; i++) {
+        pmu->groups[i].base_enabled = 0;
+        pmu->groups[i].base_running = 0;
+        if (perf_read_group(&pmu->groups[i], &r) < 0)
+            return -1;
+        pmu->groups[i].base_enabled = r.time_enabled;
+        pmu->groups[i].base_running = r.time_running;
+    }
+
+    if (perf_ioctl_groups(pmu, PERF_EVENT_IOC_ENABLE) < 0)
+        return -1;
+    pmu->running = 1;
+    return 0;
+}
+
+static int perf_stop(struct pmu *pmu, struct pmu_snapshot *snap)
+{
+    if (perf_ioctl_groups(pmu, PERF_EVENT_IOC_DISABLE) < 0)
+        return -1;
+    pmu->running = 0;
+    return snap ? perf_snapshot(pmu, snap) : 0;
+}
+
+static int perf_reopen(struct pmu *pmu)
+{
+    int running = pmu->running;
+
+    if (perf_open_events(pmu) < 0)
+        return -1;
+    return running ? perf_start(pmu) : 0;
+}
+
+static struct pmu *pmu_open_perf(void)
+{
+    struct pmu *pmu = calloc(1, sizeof(*pmu));
+    const __u32 events[] = PMU_DEFAULT_EVENTS;
+    int err;
+
+    if (!pmu)
+        return NULL;
+
+    pmu->backend = PMU_BACKEND_PERF;
+    pmu->fd = -1;
+    pmu->config.nr_events = sizeof(events) / sizeof(events[0]);
+    memcpy(pmu->config.event, events, sizeof(events));
+
+    if (perf_open_events(pmu) < 0) {
+        err = errno;
+        free(pmu);
+        errno = err;
+        return NULL;
+    }
+    return pmu;
+}
+
+static struct pmu *pmu_open_module(void)
+{
+    struct pmu *pmu = calloc(1, sizeof(*pmu));
+
+    if (!pmu)
+        return NULL;
+
+    /* read-write: the sample rings are mapped shared to update their tail */
+    pmu->backend = PMU_BACKEND_MODULE;
+    pmu->fd = open(PMU_DEV_PATH, O_RDWR | O_CLOEXEC);
+    if (pmu->fd < 0) {
+        int err = errno;
+
+        free(pmu);
+        errno = err;
+        return NULL;
+    }
+    return pmu;
+}
+
+/* PMU_BACKEND=module|perf forces one, otherwise perf when /dev/pmu is missing */
+struct pmu *pmu_open(void)
+{
+    const char *backend = getenv("PMU_BACKEND");
+    struct pmu *pmu;
+
+    if (backend && !strcmp(backend, "perf"))
+        return pmu_open_perf();
+
+    pmu = pmu_open_module();
+    if (pmu || (backend && !strcmp(backend, "module")))
+        return pmu;
+    if (errno != ENOENT && errno != ENODEV && errno != ENXIO)
+        return NULL;
+    return pmu_open_perf();
+}
+
+const char *pmu_backend_name(const struct pmu *pmu)
+{
+    return pmu->backend == PMU_BACKEND_PERF ? "perf" : "module";
+}
+
+void pmu_close(struct pmu *pmu)
+{
+    if (!pmu)
+        return;
+    if (pmu->backend == PMU_BACKEND_PERF)
+        perf_close_events(pmu);
+    else
+        close(pmu->fd);
+    free(pmu);
+}
+
+int pmu_start(struct pmu *pmu)
+{
+    if (pmu->backend == PMU_BACKEND_PERF)
+        return perf_start(pmu);
+    return ioctl(pmu->fd, PMU_IOC_START) < 0 ? -1 : 0;
+}
+
+int pmu_stop(struct pmu *pmu, struct pmu_snapshot *snap)
+{
+    if (pmu->backend == PMU_BACKEND_PERF)
+        return perf_stop(pmu, snap);
+    if (!snap)
+        return ioctl(pmu->fd, PMU_IOC_STOP) < 0 ? -1 : 0;
+    return ioctl(pmu->fd, PMU_IOC_STOP_SNAPSHOT, snap) < 0 ? -1 : 0;
+}
+
+int pmu_snapshot(struct pmu *pmu, struct pmu_snapshot *snap)
+{
+    if (pmu->backend == PMU_BACKEND_PERF)
+        return perf_snapshot(pmu, snap);
+    return ioctl(pmu->fd, PMU_IOC_SNAPSHOT, snap) < 0 ? -1 : 0;
+}
+
+int pmu_set_events(struct pmu *pmu, const __u32 *events, unsigned int nr)
+{
+    struct pmu_event_config config;
+
+    if (nr > PMU_MAX_EVENTS) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.nr_events = nr;
+    memcpy(config.event, events, nr * sizeof(*events));
+
+    if (pmu->backend == PMU_BACKEND_PERF) {
+        pmu->config = config;
+        return perf_reopen(pmu);
+    }
+    return ioctl(pmu->fd, PMU_IOC_SET_EVENTS, &config) < 0 ? -1 : 0;
+}
+
+int pmu_set_target(struct pmu *pmu, int pid, unsigned int flags)
+{
+    struct pmu_target target = {
+        .pid   = pid,
+        .flags = flags,
+    };
+
+    /* perf always follows children (inherit), pid 0 is ourselves */
+    if (pmu->backend == PMU_BACKEND_PERF) {
+        pmu->pid = pid;
+        return perf_reopen(pmu);
+    }
+    return ioctl(pmu->fd, PMU_IOC_SET_TARGET, &target) < 0 ? -1 : 0;
+}
+
+static int pmu_module_only(const struct pmu *pmu)
+{
+    if (pmu->backend == PMU_BACKEND_MODULE)
+        return 0;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int pmu_set_cpumask(struct pmu *pmu, __u64 mask)
+{
+    if (pmu_module_only(pmu) < 0)
+        return -1;
+    return ioctl(pmu->fd, PMU_IOC_SET_CPUMASK, &mask) < 0 ? -1 : 0;
+}
+
+int pmu_sample_start(struct pmu *pmu, __u32 event, __u32 period)
+{
+    struct pmu_sample_config config = {
+        .event  = event,
+        .period = period,
+    };
+
+    if (pmu_module_only(pmu) < 0)
+        return -1;
+    if (ioctl(pmu->fd, PMU_IOC_SET_SAMPLING, &config) < 0)
+        return -1;
+
+    pmu->ring_pages = config.ring_pages;
+    pmu->nr_rings = config.nr_cpus;
+    return 0;
+}
+
+int pmu_sample_stop(struct pmu *pmu)
+{
+    return pmu_sample_start(pmu, 0, 0);
+}
+
+int pmu_nr_rings(const struct pmu *pmu)
+{
+    return pmu->nr_rings;
+}
+
+struct pmu_ring *pmu_ring_map(struct pmu *pmu, int cpu)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct pmu_ring *ring;
+    void *addr;
+
+    if (!pmu->ring_pages || cpu < 0 || (unsigned int)cpu >= pmu->nr_rings) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    ring = malloc(sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->len = pmu->ring_pages * page;
+    addr = mmap(NULL, ring->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                pmu->fd, (off_t)cpu * ring->len);
+    if (addr == MAP_FAILED) {
+        int err = errno;
+
+        free(ring);
+        errno = err;
+        return NULL;
+    }
+
+    ring->hdr = addr;
+    ring->data = (struct pmu_sample *)((char *)addr + ring->hdr->data_offset);
+    ring->nr = ring->hdr->nr_records;
+    return ring;
+}
+
+void pmu_ring_unmap(struct pmu_ring *ring)
+{
+    if (!ring)
+        return;
+    munmap(ring->hdr, ring->len);
+    free(ring);
+}
+
+/* the module only rewrites a slot after it sees our release of tail */
+int pmu_ring_read(struct pmu_ring *ring, struct pmu_sample *out, int max)
+{
+    __u64 head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+    __u64 tail = ring->hdr->tail;
+    int n = 0;
+
+    while (tail != head && n < max) {
+        out[n++] = ring->data[tail % ring->nr];
+        tail++;
+    }
+
+    __atomic_store_n(&ring->hdr->tail, tail, __ATOMIC_RELEASE);
+    return n;
+}
+
+__u64 pmu_ring_lost(const struct pmu_ring *ring)
+{
+    return __atomic_load_n(&ring->hdr->lost, __ATOMIC_RELAXED);
+}
+
+int pmu_interval_start(struct pmu *pmu, unsigned int us)
+{
+    __u32 arg = us;
+
+    if (pmu_module_only(pmu) < 0)
+        return -1;
+    return ioctl(pmu->fd, PMU_IOC_SET_INTERVAL, &arg) < 0 ? -1 : 0;
+}
+
+int pmu_interval_stop(struct pmu *pmu)
+{
+    return pmu_interval_start(pmu, 0);
+}
+
+int pmu_interval_read(struct pmu *pmu, struct pmu_interval *out, int max)
+{
+    ssize_t len;
+
+    if (pmu_module_only(pmu) < 0)
+        return -1;
+
+    len = read(pmu->fd, out, (size_t)max * sizeof(*out));
+    if (len < 0)
+        return -1;
+    return len / sizeof(*out);
+}
+
+int pmu_snapshot_local(struct pmu *pmu, struct pmu_local_snapshot *snap)
+{
+    if (pmu_module_only(pmu) < 0)
+        return -1;
+    return ioctl(pmu->fd, PMU_IOC_SNAPSHOT_LOCAL, snap) < 0 ? -1 : 0;
+}
+
+int pmu_thread_init(struct pmu *pmu, struct pmu_thread *t)
+{
+    memset(t, 0, sizeof(*t));
+    return pmu_snapshot_local(pmu, &t->last);
+}
+
+static void counts_add_delta(struct pmu_counts *acc, const struct pmu_counts *now,
+                             const struct pmu_counts *base)
+{
+    unsigned int i;
+
+    acc->cycles += now->cycles - base->cycles;
+    acc->time_enabled += now->time_enabled - base->time_enabled;
+    for (i = 0; i < PMU_MAX_EVENTS; i++) {
+        acc->event[i] += now->event[i] - base->event[i];
+        acc->time_running[i] += now->time_running[i] - base->time_running[i];
+    }
+}
+
+int pmu_thread_read(struct pmu *pmu, struct pmu_thread *t,
+                    struct pmu_counts *total)
+{
+    const struct pmu_counts *a = &t->last.counts;
+    struct pmu_local_snapshot now;
+    unsigned int i;
+    int rebased = 0;
+
+    if (pmu_snapshot_local(pmu, &now) < 0)
+        return -1;
+
+    if (now.tracked && t->last.tracked) {
+        /* the module carried the thread across switches and migrations */
+        counts_add_delta(&t->raw, &now.thread, &t->last.thread);
+        if (now.restarts != t->last.restarts) {
+            t->rebases++;
+            rebased = 1;
+        }
+    } else if (now.cpu == t->last.cpu && now.switches == t->last.switches &&
+               now.active && t->last.active &&
+               now.counts.cycles >= a->cycles &&
+               now.counts.time_enabled >= a->time_enabled) {
+        /* same cpu, not switched out and the counters did not go backwards */
+        counts_add_delta(&t->raw, &now.counts, a);
+    } else {
+        /* what ran between a migration or switch is unknown, start over */
+        t->rebases++;
+        rebased = 1;
+    }
+    t->last = now;
+
+    *total = t->raw;
+    for (i = 0; i < PMU_MAX_EVENTS; i++) {
+        if (!total->time_running[i])
+            total->event[i] = 0;
+        else if (total->time_running[i] < total->time_enabled)
+            total->event[i] = (__u64)((double)total->event[i] *
+                                      total->time_enabled /
+                                      total->time_running[i]);
+    }
+    return rebased;
+}
+
+int pmu_counted(const struct pmu_counts *counts, unsigned int i)
+{
+    return counts->time_running[i] || !counts->time_enabled;
+}
+
+__u64 pmu_count(const struct pmu_snapshot *snap,
+                const struct pmu_counts *counts, __u32 event)
+{
+    unsigned int i;
+
+    for (i = 0; i < snap->config.nr_events; i++) {
+        if (snap->config.event[i] == event)
+            return counts->event[i];
+    }
+    return 0;
+}
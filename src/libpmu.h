@@ -0,0 +1,111 @@
+#ifndef LIBPMU_H
+#define LIBPMU_H
+
+#include "pmu_events.h"
+#include "pmu_ioctl.h"
+
+/*
+ * Small userspace wrapper around /dev/pmu.
+ * The descriptor is opened once in pmu_open() and reused for every
+ * start/stop/snapshot, so a phase boundary costs a single ioctl.
+ *
+ * All calls return 0 on success and -1 with errno set on failure.
+ */
+
+struct pmu;
+
+/*
+ * Opens /dev/pmu, or falls back to perf_event_open when the module is not
+ * loaded; PMU_BACKEND=module or PMU_BACKEND=perf in the environment forces
+ * one. The perf backend counts the calling process and its children
+ * (pmu_set_target() moves it to another pid), has no per-cpu split and
+ * does not support sampling or interval mode (EOPNOTSUPP).
+ */
+struct pmu *pmu_open(void);
+void pmu_close(struct pmu *pmu);
+/* "module" or "perf" */
+const char *pmu_backend_name(const struct pmu *pmu);
+
+/* reset and start the counters on every cpu */
+int pmu_start(struct pmu *pmu);
+/* stop the counters; if snap is not NULL they are read in the same step */
+int pmu_stop(struct pmu *pmu, struct pmu_snapshot *snap);
+/* read the counters without stopping them */
+int pmu_snapshot(struct pmu *pmu, struct pmu_snapshot *snap);
+/* reprogram the event counters (codes from pmu_events.h) and restart them */
+int pmu_set_events(struct pmu *pmu, const __u32 *events, unsigned int nr);
+/* count only process pid (PMU_TARGET_CHILDREN: and its descendants), 0 = all */
+int pmu_set_target(struct pmu *pmu, int pid, unsigned int flags);
+
+/* count only the cpus whose bit is set (0 = all), restarts the counters */
+int pmu_set_cpumask(struct pmu *pmu, __u64 mask);
+
+/*
+ * Sampling: every period occurrences of event, each cpu appends a
+ * struct pmu_sample to its ring. pmu_sample_start() must come before
+ * pmu_ring_map(). period 0 is the same as pmu_sample_stop().
+ */
+struct pmu_ring;
+
+int pmu_sample_start(struct pmu *pmu, __u32 event, __u32 period);
+int pmu_sample_stop(struct pmu *pmu);
+/* number of cpu rings, valid after pmu_sample_start() */
+int pmu_nr_rings(const struct pmu *pmu);
+/* map the ring of one cpu (no copy), NULL on failure */
+struct pmu_ring *pmu_ring_map(struct pmu *pmu, int cpu);
+void pmu_ring_unmap(struct pmu_ring *ring);
+/* move up to max samples out of the ring and free their slots; returns how many */
+int pmu_ring_read(struct pmu_ring *ring, struct pmu_sample *out, int max);
+/* samples the module dropped because the ring was full */
+__u64 pmu_ring_lost(const struct pmu_ring *ring);
+
+/*
+ * Interval mode: every us microseconds (PMU_INTERVAL_MIN_US..MAX_US) each
+ * cpu queues its counter deltas. pmu_interval_read() blocks for at least
+ * one record and returns how many it got, 0 once interval mode is off.
+ */
+int pmu_interval_start(struct pmu *pmu, unsigned int us);
+int pmu_interval_stop(struct pmu *pmu);
+int pmu_interval_read(struct pmu *pmu, struct pmu_interval *out, int max);
+
+/* the calling cpu's live counters, see struct pmu_local_snapshot */
+int pmu_snapshot_local(struct pmu *pmu, struct pmu_local_snapshot *snap);
+
+/*
+ * Per-thread counts from the module, without starting or stopping the
+ * counters for anyone else. Each pmu_thread_read() takes a local snapshot
+ * and adds what the module counted for the thread since the previous one,
+ * across switches and migrations. Time in which the counters restarted
+ * under the thread is lost and counted in rebases. When the module has no
+ * thread slot left, only the difference of two cpu snapshots is added,
+ * and only if the thread stayed on that cpu and was not switched out;
+ * otherwise the thread is rebased. A struct pmu_thread belongs to one
+ * thread, and the pmu can be shared.
+ */
+struct pmu_thread {
+    struct pmu_local_snapshot last;
+    struct pmu_counts raw;      /* unscaled sums since pmu_thread_init() */
+    __u64 rebases;
+};
+
+int pmu_thread_init(struct pmu *pmu, struct pmu_thread *t);
+/*
+ * fold in the counts since the last read; total is scaled like a snapshot.
+ * Returns 1 instead of 0 if the thread was rebased, so total is short of
+ * what it ran since the last read.
+ */
+int pmu_thread_read(struct pmu *pmu, struct pmu_thread *t,
+                    struct pmu_counts *total);
+
+/*
+ * 0 if event i of counts never ran, so its value means nothing: the perf
+ * backend could not open it on this host, or its multiplexed group was
+ * never scheduled. Printed as "n/a" by the tools.
+ */
+int pmu_counted(const struct pmu_counts *counts, unsigned int i);
+
+/* value of an event in counts (total or one cpu), 0 if it is not counted */
+__u64 pmu_count(const struct pmu_snapshot *snap,
+                const struct pmu_counts *counts, __u32 event);
+
+#endif /* LIBPMU_H */
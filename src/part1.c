@@ -1,14 +1,17 @@
 #include <linux/bitops.h>
 #include <linux/cpumask.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
 #include <linux/preempt.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
-#include <linux/slab.h>
+#include <linux/seqlock.h>
 #include <linux/smp.h>
-#include <asm/barrier.h>
+
+#include "pmu_backend.h"
 
 #define PROC_NAME "pmu_stats"
 
@@ -26,6 +29,7 @@
 #define COUNTER_L1D_REF      3
 #define COUNTER_L1D_MISS     4
 #define COUNTER_LLC_MISS     5
+#define COUNTER_NR           6
 
 #define COUNTER_MASK (BIT(COUNTER_INSTRUCTIONS) | \
                       BIT(COUNTER_L1I_REF) | \
@@ -37,6 +41,7 @@
 #define PMU_ENABLE_BIT    BIT(0)
 #define PMU_RESET_EVENTS  BIT(1)
 #define PMU_RESET_CYCLES  BIT(2)
+#define PMU_LONG_CYCLES   BIT(6)
 #define PMU_CYCLE_COUNTER BIT(31)
 
 struct pmu_counts {
@@ -50,64 +55,79 @@ struct pmu_counts {
 };
 
 static struct proc_dir_entry *pmu_proc;
+static const struct pmu_backend_ops *pmu_ops;
+
+static char *backend = PMU_BACKEND_DEFAULT;
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Register backend: armv8 (the real PMU) or sim (software model)");
+
+module_param_named(sim_step, pmu_sim_step, uint, 0444);
+MODULE_PARM_DESC(sim_step, "sim backend: cycles added on every counter read");
+
+static unsigned int publish_ms = 10;
+module_param(publish_ms, uint, 0444);
+MODULE_PARM_DESC(publish_ms, "Per-CPU counter publish period in ms");
+
+struct pmu_cpu_state {
+    seqcount_t seq;
+    struct pmu_counts counts;
+    u64 stamp_ns;
+    struct hrtimer timer;
+    /* upper bits of the 32-bit event counters */
+    u64 overflow[COUNTER_NR];
+};
+
+static DEFINE_PER_CPU(struct pmu_cpu_state, pmu_cpu_state);
 
 
 static inline void write_pmselr_el0(u64 val)
 {
-    asm volatile("msr pmselr_el0, %0" :: "r"(val));
-    isb();
+    pmu_ops->write_pmselr_el0(val);
 }
 
 static inline void write_pmxevtyper_el0(u64 val)
 {
-    asm volatile("msr pmxevtyper_el0, %0" :: "r"(val));
-    isb();
+    pmu_ops->write_pmxevtyper_el0(val);
 }
 
 static inline void write_pmxevcntr_el0(u64 val)
 {
-    asm volatile("msr pmxevcntr_el0, %0" :: "r"(val));
-    isb();
+    pmu_ops->write_pmxevcntr_el0(val);
 }
 
 static inline u64 read_pmxevcntr_el0(void)
 {
-    u64 val;
-
-    asm volatile("mrs %0, pmxevcntr_el0" : "=r"(val));
-    return val;
+    return pmu_ops->read_pmxevcntr_el0();
 }
 
 static inline u64 read_pmccntr_el0(void)
 {
-    u64 val;
-
-    asm volatile("mrs %0, pmccntr_el0" : "=r"(val));
-    return val;
+    return pmu_ops->read_pmccntr_el0();
 }
 
 static inline void write_pmcr_el0(u64 val)
 {
-    asm volatile("msr pmcr_el0, %0" :: "r"(val));
-    isb();
+    pmu_ops->write_pmcr_el0(val);
 }
 
 static inline void write_pmcntenset_el0(u64 val)
 {
-    asm volatile("msr pmcntenset_el0, %0" :: "r"(val));
-    isb();
+    pmu_ops->write_pmcntenset_el0(val);
 }
 
 static inline void write_pmcntenclr_el0(u64 val)
 {
-    asm volatile("msr pmcntenclr_el0, %0" :: "r"(val));
-    isb();
+    pmu_ops->write_pmcntenclr_el0(val);
 }
 
 static inline void write_pmovsclr_el0(u64 val)
 {
-    asm volatile("msr pmovsclr_el0, %0" :: "r"(val));
-    isb();
+    pmu_ops->write_pmovsclr_el0(val);
+}
+
+static inline u64 read_pmovsclr_el0(void)
+{
+    return pmu_ops->read_pmovsclr_el0();
 }
 
 static inline u64 read_event_counter(u32 counter)
@@ -130,7 +150,8 @@ static void pmu_reset_cpu(void *unused)
     write_pmovsclr_el0(~0U);
 
     
-    write_pmcr_el0(PMU_ENABLE_BIT | PMU_RESET_EVENTS | PMU_RESET_CYCLES);
+    write_pmcr_el0(PMU_ENABLE_BIT | PMU_RESET_EVENTS | PMU_RESET_CYCLES |
+                   PMU_LONG_CYCLES);
 
     pmu_program_counter(COUNTER_INSTRUCTIONS, EVT_INSTR_RETIRED);
     pmu_program_counter(COUNTER_L1I_REF, EVT_L1I_ACCESS);
@@ -147,51 +168,122 @@ static void pmu_disable_cpu(void *unused)
     write_pmcntenclr_el0(COUNTER_MASK | PMU_CYCLE_COUNTER);
 }
 
+/*
+ * No overflow interrupt here: the publish timer polls PMOVSSET often
+ * enough that a 32-bit counter cannot wrap twice in between.
+ */
+static void pmu_fold_overflow(struct pmu_cpu_state *st)
+{
+    u64 ovs = read_pmovsclr_el0() & (COUNTER_MASK | PMU_CYCLE_COUNTER);
+    u32 counter;
+
+    if (!ovs)
+        return;
+
+    write_pmovsclr_el0(ovs);
+
+    for (counter = 0; counter < COUNTER_NR; counter++) {
+        if (ovs & BIT(counter))
+            st->overflow[counter] += BIT_ULL(32);
+    }
+}
+
 static void pmu_read_local(struct pmu_counts *snapshot)
 {
-    preempt_disable();
-    snapshot->instructions = read_event_counter(COUNTER_INSTRUCTIONS);
-    snapshot->l1i_ref = read_event_counter(COUNTER_L1I_REF);
-    snapshot->l1i_miss = read_event_counter(COUNTER_L1I_MISS);
-    snapshot->l1d_ref = read_event_counter(COUNTER_L1D_REF);
-    snapshot->l1d_miss = read_event_counter(COUNTER_L1D_MISS);
-    snapshot->llc_miss = read_event_counter(COUNTER_LLC_MISS);
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    u64 raw[COUNTER_NR];
+    unsigned long flags;
+    u32 counter;
+
+    local_irq_save(flags);
+
+    do {
+        pmu_fold_overflow(st);
+        for (counter = 0; counter < COUNTER_NR; counter++)
+            raw[counter] = read_event_counter(counter);
+    } while (read_pmovsclr_el0() & COUNTER_MASK);
+
+    snapshot->instructions = st->overflow[COUNTER_INSTRUCTIONS] + raw[COUNTER_INSTRUCTIONS];
+    snapshot->l1i_ref = st->overflow[COUNTER_L1I_REF] + raw[COUNTER_L1I_REF];
+    snapshot->l1i_miss = st->overflow[COUNTER_L1I_MISS] + raw[COUNTER_L1I_MISS];
+    snapshot->l1d_ref = st->overflow[COUNTER_L1D_REF] + raw[COUNTER_L1D_REF];
+    snapshot->l1d_miss = st->overflow[COUNTER_L1D_MISS] + raw[COUNTER_L1D_MISS];
+    snapshot->llc_miss = st->overflow[COUNTER_LLC_MISS] + raw[COUNTER_LLC_MISS];
     snapshot->cycles = read_pmccntr_el0();
-    preempt_enable();
+
+    local_irq_restore(flags);
 }
 
-static void pmu_collect_cpu(void *info)
+/* runs on the owning cpu in hardirq context, readers retry on the seqcount */
+static void pmu_publish_local(void)
 {
-    struct pmu_counts *per_cpu_counts = info;
-    unsigned int cpu = smp_processor_id();
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    struct pmu_counts counts;
+
+    pmu_read_local(&counts);
 
-    pmu_read_local(&per_cpu_counts[cpu]);
+    write_seqcount_begin(&st->seq);
+    st->counts = counts;
+    st->stamp_ns = ktime_get_ns();
+    write_seqcount_end(&st->seq);
+}
+
+static enum hrtimer_restart pmu_publish_timer_fn(struct hrtimer *timer)
+{
+    pmu_publish_local();
+    hrtimer_forward_now(timer, ms_to_ktime(publish_ms));
+    return HRTIMER_RESTART;
+}
+
+static void pmu_start_cpu(void *unused)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+
+    pmu_reset_cpu(NULL);
+    pmu_publish_local();
+    hrtimer_start(&st->timer, ms_to_ktime(publish_ms),
+                  HRTIMER_MODE_REL_PINNED);
+}
+
+static u64 pmu_read_published(unsigned int cpu, struct pmu_counts *counts)
+{
+    struct pmu_cpu_state *st = per_cpu_ptr(&pmu_cpu_state, cpu);
+    unsigned int seq;
+    u64 stamp;
+
+    do {
+        seq = read_seqcount_begin(&st->seq);
+        *counts = st->counts;
+        stamp = st->stamp_ns;
+    } while (read_seqcount_retry(&st->seq, seq));
+
+    return stamp;
 }
 
 static int pmu_proc_show(struct seq_file *m, void *v)
 {
     struct pmu_counts total = {};
-    struct pmu_counts *per_cpu_counts;
+    struct pmu_counts counts;
+    u64 now = ktime_get_ns();
+    u64 staleness = 0;
+    u64 stamp;
     unsigned int cpu;
 
-    per_cpu_counts = kcalloc(nr_cpu_ids, sizeof(*per_cpu_counts), GFP_KERNEL);
-    if (!per_cpu_counts)
-        return -ENOMEM;
-
-    on_each_cpu(pmu_collect_cpu, per_cpu_counts, 1);
-
     for_each_online_cpu(cpu) {
-        total.instructions += per_cpu_counts[cpu].instructions;
-        total.l1i_ref += per_cpu_counts[cpu].l1i_ref;
-        total.l1i_miss += per_cpu_counts[cpu].l1i_miss;
-        total.l1d_ref += per_cpu_counts[cpu].l1d_ref;
-        total.l1d_miss += per_cpu_counts[cpu].l1d_miss;
-        total.llc_miss += per_cpu_counts[cpu].llc_miss;
-        total.cycles += per_cpu_counts[cpu].cycles;
+        stamp = pmu_read_published(cpu, &counts);
+
+        total.instructions += counts.instructions;
+        total.l1i_ref += counts.l1i_ref;
+        total.l1i_miss += counts.l1i_miss;
+        total.l1d_ref += counts.l1d_ref;
+        total.l1d_miss += counts.l1d_miss;
+        total.llc_miss += counts.llc_miss;
+        total.cycles += counts.cycles;
+
+        if (now > stamp)
+            staleness = max(staleness, now - stamp);
     }
 
-    kfree(per_cpu_counts);
-
     seq_printf(m, "instructions: %llu\n", total.instructions);
     seq_printf(m, "l1i_references: %llu\n", total.l1i_ref);
     seq_printf(m, "l1i_misses: %llu\n", total.l1i_miss);
@@ -199,6 +291,9 @@ static int pmu_proc_show(struct seq_file *m, void *v)
     seq_printf(m, "l1d_misses: %llu\n", total.l1d_miss);
     seq_printf(m, "llc_misses: %llu\n", total.llc_miss);
     seq_printf(m, "cycles: %llu\n", total.cycles);
+    seq_printf(m, "staleness_ns: %llu\n", staleness);
+    if (strcmp(pmu_ops->name, "armv8"))
+        seq_printf(m, "backend: %s\n", pmu_ops->name);
 
     return 0;
 }
@@ -215,14 +310,43 @@ static const struct proc_ops pmu_proc_fops = {
     .proc_release = single_release,
 };
 
+static void pmu_stop_timers(void)
+{
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu)
+        hrtimer_cancel(&per_cpu_ptr(&pmu_cpu_state, cpu)->timer);
+}
+
 static int __init pmu_init(void)
 {
-    pr_info("pmu: programming counters for Raspberry Pi 4\n");
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    pmu_ops = pmu_backend_find(backend);
+    if (!pmu_ops) {
+        pr_err("pmu: unknown backend %s\n", backend);
+        return -EINVAL;
+    }
+
+    pr_info("pmu: programming counters for Raspberry Pi 4 (%s backend)\n",
+            pmu_ops->name);
+
+    if (!publish_ms)
+        publish_ms = 1;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        seqcount_init(&st->seq);
+        hrtimer_init(&st->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+        st->timer.function = pmu_publish_timer_fn;
+    }
 
-    on_each_cpu(pmu_reset_cpu, NULL, 1);
+    on_each_cpu(pmu_start_cpu, NULL, 1);
 
     pmu_proc = proc_create(PROC_NAME, 0444, NULL, &pmu_proc_fops);
     if (!pmu_proc) {
+        pmu_stop_timers();
         on_each_cpu(pmu_disable_cpu, NULL, 1);
         return -ENOMEM;
     }
@@ -235,6 +359,7 @@ static void __exit pmu_exit(void)
     if (pmu_proc)
         proc_remove(pmu_proc);
 
+    pmu_stop_timers();
     on_each_cpu(pmu_disable_cpu, NULL, 1);
     pr_info("pmu: module unloaded\n");
 }
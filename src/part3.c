@@ -1,59 +1,68 @@
 #include <linux/bitops.h>
+#include <linux/capability.h>
+#include <linux/cred.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
 #include <linux/cpumask.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/of.h>
+#include <linux/of_irq.h>
+#include <linux/pid.h>
 #include <linux/preempt.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
+#include <linux/ptrace.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/sched/task.h>
 #include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
 #include <linux/smp.h>
+#include <linux/syscore_ops.h>
 #include <linux/mutex.h>
+#include <linux/tracepoint.h>
 #include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/vmalloc.h>
 #include <asm/barrier.h>
+#include <asm/irq_regs.h>
+
+#include "pmu_backend.h"
+#include "pmu_events.h"
+#include "pmu_ioctl.h"
 
 #define PROC_NAME_STATS   "pmu_stats"
 #define PROC_NAME_CONTROL "pmu_control"
+#define PROC_NAME_PERCPU  "pmu_stats_percpu"
 
 
-#define EVT_INSTR_RETIRED   0x08
-#define EVT_L1I_REFILL      0x01
-#define EVT_L1I_ACCESS      0x14
-#define EVT_L1D_REFILL      0x03
-#define EVT_L1D_ACCESS      0x04
-#define EVT_LLC_REFILL      0x17
-
-#define COUNTER_INSTRUCTIONS 0
-#define COUNTER_L1I_REF      1
-#define COUNTER_L1I_MISS     2
-#define COUNTER_L1D_REF      3
-#define COUNTER_L1D_MISS     4
-#define COUNTER_LLC_MISS     5
-
-#define COUNTER_MASK (BIT(COUNTER_INSTRUCTIONS) |      \
-                      BIT(COUNTER_L1I_REF)   |         \
-                      BIT(COUNTER_L1I_MISS)  |         \
-                      BIT(COUNTER_L1D_REF)   |         \
-                      BIT(COUNTER_L1D_MISS)  |         \
-                      BIT(COUNTER_LLC_MISS))
+#define EVENT_COUNTERS_ALL GENMASK(30, 0)
 
 #define PMU_ENABLE_BIT    BIT(0)
 #define PMU_RESET_EVENTS  BIT(1)
 #define PMU_RESET_CYCLES  BIT(2)
+#define PMU_LONG_CYCLES   BIT(6)
 #define PMU_CYCLE_COUNTER BIT(31)
-
-struct pmu_counts {
-    u64 instructions;
-    u64 l1i_ref;
-    u64 l1i_miss;
-    u64 l1d_ref;
-    u64 l1d_miss;
-    u64 llc_miss;
-    u64 cycles;
-};
+#define PMCR_N_SHIFT      11
+#define PMCR_N_MASK       0x1f
+#define PMUSERENR_CR      BIT(2)
+#define PMUSERENR_ER      BIT(3)
 
 static struct proc_dir_entry *pmu_proc_stats;
 static struct proc_dir_entry *pmu_proc_ctrl;
+static struct proc_dir_entry *pmu_proc_percpu;
 
 
 enum pmu_state {
@@ -63,177 +72,943 @@ enum pmu_state {
 
 static enum pmu_state pmu_state = PMU_STOPPED;
 static DEFINE_MUTEX(pmu_ctrl_lock);
+static bool pmu_irq_enabled;
+
+static const struct pmu_backend_ops *pmu_ops;
+
+/* number of event counters (PMCR_EL0.N) */
+static u32 pmu_nr_counters;
+
+/* cpus that are programmed, read and summed; changed under pmu_ctrl_lock */
+static struct cpumask pmu_cpus;
+static int pmu_hp_state;
+
+/* event[i] is programmed into counter i; changed under pmu_ctrl_lock while stopped */
+static struct pmu_event_config pmu_config = {
+    .nr_events = 6,
+    .event     = PMU_DEFAULT_EVENTS,
+};
+
+/* per-task mode: only count while a thread of pmu_target_tgid is on the cpu */
+static pid_t pmu_target_tgid;
+static u32 pmu_target_flags;
+/* set when an unprivileged caller chose the target: count only its own tasks */
+static bool pmu_target_restricted;
+static kuid_t pmu_target_uid;
+static struct tracepoint *pmu_tp_sched_switch;
+
+/* sampling: the last counter overflows every pmu_sample_period events */
+static u32 pmu_sample_event;
+static u32 pmu_sample_period;
+static u32 pmu_sample_counter;
+static u32 pmu_sample_mask;     /* BIT(pmu_sample_counter) while sampling, else 0 */
+
+/* interval mode: 0 = off */
+static u64 pmu_interval_ns;
+static DEFINE_MUTEX(pmu_interval_read_lock);
+static DECLARE_WAIT_QUEUE_HEAD(pmu_interval_wait);
+
+static char *backend = PMU_BACKEND_DEFAULT;
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Register backend: armv8 (the real PMU) or sim (software model)");
+
+module_param_named(sim_step, pmu_sim_step, uint, 0444);
+MODULE_PARM_DESC(sim_step, "sim backend: cycles added on every counter read");
+
+static bool user_access;
+module_param(user_access, bool, 0444);
+MODULE_PARM_DESC(user_access, "Let EL0 read the cycle and event counters directly (PMUSERENR_EL0.CR/ER, see pmu_fast.h)");
+
+static unsigned int param_events[PMU_MAX_EVENTS];
+static int param_nr_events;
+module_param_array_named(events, param_events, uint, &param_nr_events, 0444);
+MODULE_PARM_DESC(events, "Event codes to count, e.g. events=0x08,0x10,0x05 (default: the part1 six)");
+
+static unsigned int publish_ms = 10;
+module_param(publish_ms, uint, 0444);
+MODULE_PARM_DESC(publish_ms, "Per-CPU counter publish period in ms (staleness bound of pmu_stats)");
+
+static unsigned int mux_ms = 4;
+module_param(mux_ms, uint, 0444);
+MODULE_PARM_DESC(mux_ms, "Rotation period in ms when more events than counters are configured");
+
+static bool use_irq = true;
+module_param(use_irq, bool, 0444);
+MODULE_PARM_DESC(use_irq, "Extend counters from the PMU overflow interrupt (falls back to polling from the publish timer)");
+
+static unsigned int sample_pages = 64;
+module_param(sample_pages, uint, 0444);
+MODULE_PARM_DESC(sample_pages, "Pages per CPU sample ring, including the header page");
+
+static bool kernel_pc;
+module_param(kernel_pc, bool, 0444);
+MODULE_PARM_DESC(kernel_pc, "Record the PC of samples taken in kernel mode (default: 0, which hides kernel addresses)");
+
+static unsigned int interval_records = 256;
+module_param(interval_records, uint, 0444);
+MODULE_PARM_DESC(interval_records, "Per-CPU buffer of interval records waiting for read()");
+
+struct pmu_cpu_state {
+    seqcount_t seq;
+    struct pmu_counts counts;
+    u64 stamp_ns;
+    /* what the cpu had counted before it last went offline, part of counts */
+    struct pmu_counts retained;
+    struct hrtimer timer;
+    struct hrtimer mux_timer;
+    /* the rest is owned by the cpu and only touched with irqs off */
+    u64 overflow[PMU_MAX_EVENTS];       /* upper bits, per hardware counter */
+    u64 accum[PMU_MAX_EVENTS];          /* per event, from rotated-out groups */
+    u64 time_running[PMU_MAX_EVENTS];   /* per group */
+    u64 time_enabled;
+    u64 enabled_since;
+    u64 group_since;
+    u32 group;
+    bool active;
+    u64 epoch;                          /* bumped by every counter reset */
+    int irq;
+    /* per-task mode, updated from the sched_switch probe */
+    bool task_mode;
+    bool task_on;
+    struct pmu_counts task_base;
+    struct pmu_counts task_accum;
+    /* sample ring, allocated the first time sampling is armed */
+    struct pmu_ring_header *ring;
+    u32 ring_nr;
+    /* interval mode; the tick produces, read() consumes */
+    struct hrtimer interval_timer;
+    struct pmu_counts interval_base;
+    struct pmu_interval *iv_buf;
+    u64 iv_head;
+    u64 iv_tail;
+    u64 iv_lost;
+};
+
+static DEFINE_PER_CPU(struct pmu_cpu_state, pmu_cpu_state);
+
+#include "pmu_counters.h"
+
+static enum hrtimer_restart pmu_mux_timer_fn(struct hrtimer *timer)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    u64 now = ktime_get_ns();
+
+    pmu_rotate(st, now);
+
+    hrtimer_forward_now(timer, ms_to_ktime(mux_ms));
+    return HRTIMER_RESTART;
+}
+
+
+
+/*
+ * Only the owning cpu writes its ring, from the overflow irq, so the
+ * producer side needs no lock: the acquire on tail keeps a slot from being
+ * overwritten before the reader is done with it, the release on head
+ * publishes the record. See struct pmu_ring_header for the reader side.
+ */
+static void pmu_ring_write(struct pmu_cpu_state *st,
+                           const struct pmu_sample *sample)
+{
+    struct pmu_ring_header *ring = st->ring;
+    struct pmu_sample *slots = (void *)ring + PAGE_SIZE;
+    u64 head = ring->head;
+
+    if (head - smp_load_acquire(&ring->tail) >= st->ring_nr) {
+        WRITE_ONCE(ring->lost, ring->lost + 1);
+        return;
+    }
+
+    slots[head % st->ring_nr] = *sample;
+    smp_store_release(&ring->head, head + 1);
+}
+
+static void pmu_sample_overflow(struct pmu_cpu_state *st)
+{
+    struct pt_regs *regs = get_irq_regs();
+    struct pmu_sample sample;
+    u64 vals[PMU_MAX_EVENTS];
+    u32 i;
+
+    write_pmselr_el0(pmu_sample_counter);
+    write_pmxevcntr_el0((u32)-pmu_sample_period);
+    write_pmovsclr_el0(pmu_sample_mask);
+
+    if (!st->ring || !regs || !st->active)
+        return;
+    /* in per-task mode only the target's samples are kept */
+    if (st->task_mode && !st->task_on)
+        return;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.user = user_mode(regs);
+    if (sample.user || kernel_pc)
+        sample.pc = instruction_pointer(regs);
+    sample.time_ns = ktime_get_ns();
+    sample.pid = current->pid;
+    sample.tgid = current->tgid;
+    sample.cpu = smp_processor_id();
+    sample.cycles = read_pmccntr_el0();
+    sample.first = pmu_group_first(st->group);
+    sample.nr = min_t(u32, pmu_group_size(st->group), PMU_SAMPLE_MAX_COUNTERS);
+
+    pmu_read_group(st, vals);
+    for (i = 0; i < sample.nr; i++)
+        sample.counter[i] = vals[i];
+
+    pmu_ring_write(st, &sample);
+}
+
+static irqreturn_t pmu_overflow_irq(int irq, void *dev)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    u32 ovs = read_pmovsclr_el0();
 
+    if (!(ovs & (EVENT_COUNTERS_ALL | PMU_CYCLE_COUNTER)))
+        return IRQ_NONE;
 
-static inline void write_pmselr_el0(u64 val)
+    if (ovs & pmu_sample_mask)
+        pmu_sample_overflow(st);
+    pmu_fold_overflow(st);
+    return IRQ_HANDLED;
+}
+
+
+
+/*
+ * Per-task mode. The counters keep running system wide; on every context
+ * switch that moves the target onto or off a cpu, the probe takes the
+ * cpu-wide counts and adds the difference since the switch-in to that
+ * cpu's task_accum. Switching between two threads of the target does not
+ * interrupt the count.
+ */
+#define PMU_TASK_MAX_DEPTH 64
+
+/* a task that exec'd a setuid binary no longer belongs to the owner */
+static bool pmu_task_owned(struct task_struct *p)
+{
+    const struct cred *cred;
+    bool owned;
+
+    if (!READ_ONCE(pmu_target_restricted))
+        return true;
+
+    rcu_read_lock();
+    cred = __task_cred(p);
+    owned = uid_eq(cred->uid, pmu_target_uid) &&
+            uid_eq(cred->euid, pmu_target_uid) &&
+            uid_eq(cred->suid, pmu_target_uid);
+    rcu_read_unlock();
+
+    return owned;
+}
+
+static bool pmu_task_match(struct task_struct *p)
+{
+    pid_t tgid = READ_ONCE(pmu_target_tgid);
+    struct task_struct *t;
+    bool match = false;
+    int depth;
+
+    if (p->tgid == tgid)
+        return pmu_task_owned(p);
+    if (!(READ_ONCE(pmu_target_flags) & PMU_TARGET_CHILDREN))
+        return false;
+    if (!pmu_task_owned(p))
+        return false;
+
+    rcu_read_lock();
+    t = rcu_dereference(p->real_parent);
+    for (depth = 0; depth < PMU_TASK_MAX_DEPTH && t->pid > 1; depth++) {
+        if (t->tgid == tgid) {
+            match = true;
+            break;
+        }
+        t = rcu_dereference(t->real_parent);
+    }
+    rcu_read_unlock();
+
+    return match;
+}
+
+static void pmu_counts_add_delta(struct pmu_counts *acc,
+                                 const struct pmu_counts *now,
+                                 const struct pmu_counts *base)
 {
-    asm volatile("msr pmselr_el0, %0" :: "r"(val));
-    isb();
+    u32 i;
+
+    for (i = 0; i < pmu_config.nr_events; i++) {
+        acc->event[i] += now->event[i] - base->event[i];
+        acc->time_running[i] += now->time_running[i] - base->time_running[i];
+    }
+    acc->time_enabled += now->time_enabled - base->time_enabled;
+    acc->cycles += now->cycles - base->cycles;
+}
+
+static void pmu_task_sched_in(struct pmu_cpu_state *st)
+{
+    pmu_read_local(&st->task_base);
+    st->task_on = true;
 }
 
-static inline void write_pmxevtyper_el0(u64 val)
+static void pmu_task_sched_out(struct pmu_cpu_state *st)
 {
-    asm volatile("msr pmxevtyper_el0, %0" :: "r"(val));
-    isb();
+    struct pmu_counts now;
+
+    pmu_read_local(&now);
+    pmu_counts_add_delta(&st->task_accum, &now, &st->task_base);
+    st->task_on = false;
 }
 
-static inline void write_pmxevcntr_el0(u64 val)
+/* called from the start IPI, right after the counters were reset */
+static void pmu_task_reset(struct pmu_cpu_state *st)
 {
-    asm volatile("msr pmxevcntr_el0, %0" :: "r"(val));
-    isb();
+    st->task_mode = READ_ONCE(pmu_target_tgid) != 0;
+    st->task_on = false;
+    memset(&st->task_accum, 0, sizeof(st->task_accum));
+
+    if (st->task_mode && pmu_task_match(current))
+        pmu_task_sched_in(st);
 }
 
-static inline u64 read_pmxevcntr_el0(void)
+/* turn cpu-wide counts into the target's counts on this cpu */
+static void pmu_task_view(struct pmu_cpu_state *st, struct pmu_counts *counts)
 {
-    u64 val;
+    struct pmu_counts live;
+
+    if (!st->task_on) {
+        *counts = st->task_accum;
+        return;
+    }
+
+    live = *counts;
+    *counts = st->task_accum;
+    pmu_counts_add_delta(counts, &live, &st->task_base);
+}
+
+/*
+ * Per-thread counts for PMU_IOC_SNAPSHOT_LOCAL. A thread gets a slot on
+ * its first local snapshot and keeps it until the file is released or,
+ * once it exited, the slot is needed. The sched_switch probe adds the
+ * cpu's counts since the switch-in to accum when the thread switches out,
+ * wherever it runs next. A stint that saw the cpu's counters reset is
+ * lost and counted in restarts. Between allocation and release a slot is
+ * only written by the cpu the thread is on, with irqs off.
+ */
+struct pmu_thread_slot {
+    struct task_struct *task;   /* NULL: unused or being freed */
+    struct file *file;          /* NULL: free */
+    bool on;
+    u64 epoch;
+    u32 restarts;
+    struct pmu_counts base;
+    struct pmu_counts accum;
+};
+
+static struct pmu_thread_slot pmu_threads[PMU_THREADS_MAX];
+static unsigned int pmu_threads_hi;     /* slots in use are below this */
 
-    asm volatile("mrs %0, pmxevcntr_el0" : "=r"(val));
-    return val;
+static void pmu_thread_in(struct pmu_cpu_state *st, struct pmu_thread_slot *t,
+                          const struct pmu_counts *now)
+{
+    t->base = *now;
+    t->epoch = st->epoch;
+    t->on = st->active;
 }
 
-static inline u64 read_pmccntr_el0(void)
+/* accum plus the running stint, without ending it */
+static void pmu_thread_view(struct pmu_cpu_state *st, struct pmu_thread_slot *t,
+                            const struct pmu_counts *now,
+                            struct pmu_counts *counts, u32 *restarts)
 {
-    u64 val;
+    *counts = t->accum;
+    *restarts = t->restarts;
+    if (!t->on)
+        return;
+    if (t->epoch == st->epoch)
+        pmu_counts_add_delta(counts, now, &t->base);
+    else
+        (*restarts)++;
+}
 
-    asm volatile("mrs %0, pmccntr_el0" : "=r"(val));
-    return val;
+static void pmu_thread_out(struct pmu_cpu_state *st, struct pmu_thread_slot *t,
+                           const struct pmu_counts *now)
+{
+    pmu_thread_view(st, t, now, &t->accum, &t->restarts);
+    t->on = false;
 }
 
-static inline void write_pmcr_el0(u64 val)
+/* file NULL matches the slot of task from any file */
+static struct pmu_thread_slot *pmu_thread_find(struct task_struct *task,
+                                               struct file *file)
 {
-    asm volatile("msr pmcr_el0, %0" :: "r"(val));
-    isb();
+    unsigned int i, hi = READ_ONCE(pmu_threads_hi);
+    struct pmu_thread_slot *t;
+
+    for (i = 0; i < hi; i++) {
+        t = &pmu_threads[i];
+        if (smp_load_acquire(&t->task) == task && (!file || t->file == file))
+            return t;
+    }
+    return NULL;
 }
 
-static inline void write_pmcntenset_el0(u64 val)
+/* from the start IPI: the counters were reset under the thread on this cpu */
+static void pmu_thread_reset(struct pmu_cpu_state *st)
 {
-    asm volatile("msr pmcntenset_el0, %0" :: "r"(val));
-    isb();
+    struct pmu_thread_slot *t = pmu_thread_find(current, NULL);
+    struct pmu_counts now;
+
+    if (!t)
+        return;
+    pmu_read_local(&now);
+    pmu_thread_out(st, t, &now);
+    pmu_thread_in(st, t, &now);
 }
 
-static inline void write_pmcntenclr_el0(u64 val)
+static void pmu_thread_switch(struct pmu_cpu_state *st,
+                              struct task_struct *prev,
+                              struct task_struct *next)
 {
-    asm volatile("msr pmcntenclr_el0, %0" :: "r"(val));
-    isb();
+    unsigned int i, hi = READ_ONCE(pmu_threads_hi);
+    struct pmu_thread_slot *t;
+    struct task_struct *task;
+    struct pmu_counts now;
+    bool read = false;
+
+    for (i = 0; i < hi; i++) {
+        t = &pmu_threads[i];
+        task = smp_load_acquire(&t->task);
+        if (!task || (task != prev && task != next))
+            continue;
+        if (!read) {
+            pmu_read_local(&now);
+            read = true;
+        }
+        if (task == prev)
+            pmu_thread_out(st, t, &now);
+        else
+            pmu_thread_in(st, t, &now);
+    }
 }
 
-static inline void write_pmovsclr_el0(u64 val)
+/* runs with irqs off under the runqueue lock */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+static void pmu_sched_switch_probe(void *data, bool preempt,
+                                   struct task_struct *prev,
+                                   struct task_struct *next,
+                                   unsigned int prev_state)
+#else
+static void pmu_sched_switch_probe(void *data, bool preempt,
+                                   struct task_struct *prev,
+                                   struct task_struct *next)
+#endif
 {
-    asm volatile("msr pmovsclr_el0, %0" :: "r"(val));
-    isb();
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    bool in;
+
+    if (READ_ONCE(pmu_threads_hi))
+        pmu_thread_switch(st, prev, next);
+    if (!st->task_mode)
+        return;
+
+    in = pmu_task_match(next);
+    if (in == st->task_on)
+        return;
+
+    if (in)
+        pmu_task_sched_in(st);
+    else
+        pmu_task_sched_out(st);
 }
 
-static inline u64 read_event_counter(u32 counter)
+/*
+ * Every cpu publishes its own counters into pmu_cpu_state from its
+ * publish timer (and from the start/stop IPIs), so readers never have to
+ * interrupt the cpus they are measuring. Writers always run on the owning
+ * cpu in hardirq context, readers only retry on the seqcount.
+ */
+static void pmu_read_view(struct pmu_cpu_state *st, struct pmu_counts *counts)
 {
-    write_pmselr_el0(counter);
-    return read_pmxevcntr_el0();
+    pmu_read_local(counts);
+    if (st->task_mode)
+        pmu_task_view(st, counts);
 }
 
-static void pmu_program_counter(u32 counter, u32 event)
+static void pmu_counts_add(struct pmu_counts *acc, const struct pmu_counts *c)
 {
-    write_pmselr_el0(counter);
-    write_pmxevtyper_el0(event);
-    write_pmxevcntr_el0(0);
+    u32 i;
+
+    for (i = 0; i < PMU_MAX_EVENTS; i++) {
+        acc->event[i] += c->event[i];
+        acc->time_running[i] += c->time_running[i];
+    }
+    acc->time_enabled += c->time_enabled;
+    acc->cycles += c->cycles;
 }
 
+static void pmu_publish_local(void)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    struct pmu_counts counts;
 
+    pmu_read_view(st, &counts);
+    pmu_counts_add(&counts, &st->retained);
 
+    write_seqcount_begin(&st->seq);
+    st->counts = counts;
+    st->stamp_ns = ktime_get_ns();
+    write_seqcount_end(&st->seq);
+}
 
+static enum hrtimer_restart pmu_publish_timer_fn(struct hrtimer *timer)
+{
+    pmu_publish_local();
+    hrtimer_forward_now(timer, ms_to_ktime(publish_ms));
+    return HRTIMER_RESTART;
+}
 
-static void pmu_reset_cpu(void *unused)
+/*
+ * Interval mode. Each cpu's tick appends its delta to its own buffer, and
+ * read() is the only consumer, so like the sample rings it is a
+ * single-producer ring ordered by the acquire/release on head and tail.
+ */
+static void pmu_interval_emit(struct pmu_cpu_state *st)
 {
-    
-    write_pmcntenclr_el0(COUNTER_MASK | PMU_CYCLE_COUNTER);
-    write_pmovsclr_el0(~0U);
+    struct pmu_interval *rec;
+    struct pmu_counts now;
+    u64 head = st->iv_head;
 
-    
-    write_pmcr_el0(PMU_ENABLE_BIT | PMU_RESET_EVENTS | PMU_RESET_CYCLES);
+    pmu_read_view(st, &now);
 
-    pmu_program_counter(COUNTER_INSTRUCTIONS, EVT_INSTR_RETIRED);
-    pmu_program_counter(COUNTER_L1I_REF,      EVT_L1I_ACCESS);
-    pmu_program_counter(COUNTER_L1I_MISS,     EVT_L1I_REFILL);
-    pmu_program_counter(COUNTER_L1D_REF,      EVT_L1D_ACCESS);
-    pmu_program_counter(COUNTER_L1D_MISS,     EVT_L1D_REFILL);
-    pmu_program_counter(COUNTER_LLC_MISS,     EVT_LLC_REFILL);
+    if (head - smp_load_acquire(&st->iv_tail) >= interval_records) {
+        st->iv_lost++;
+    } else {
+        rec = &st->iv_buf[head % interval_records];
+        memset(rec, 0, sizeof(*rec));
+        rec->time_ns = ktime_get_ns();
+        rec->cpu = smp_processor_id();
+        rec->nr_events = pmu_config.nr_events;
+        rec->lost = st->iv_lost;
+        pmu_counts_add_delta(&rec->delta, &now, &st->interval_base);
+        smp_store_release(&st->iv_head, head + 1);
+
+        if (wq_has_sleeper(&pmu_interval_wait))
+            wake_up_interruptible(&pmu_interval_wait);
+    }
+    st->interval_base = now;
+}
 
-    write_pmcntenset_el0(COUNTER_MASK | PMU_CYCLE_COUNTER);
+static enum hrtimer_restart pmu_interval_timer_fn(struct hrtimer *timer)
+{
+    pmu_interval_emit(this_cpu_ptr(&pmu_cpu_state));
+    hrtimer_forward_now(timer, ns_to_ktime(pmu_interval_ns));
+    return HRTIMER_RESTART;
 }
 
-static void pmu_disable_cpu(void *unused)
+/* keep_retained is only set when a cpu comes back online mid-run */
+static void pmu_start_cpu(void *keep_retained)
 {
-    write_pmcntenclr_el0(COUNTER_MASK | PMU_CYCLE_COUNTER);
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+
+    if (!keep_retained)
+        memset(&st->retained, 0, sizeof(st->retained));
+
+    pmu_reset_cpu(NULL);
+    pmu_task_reset(st);
+    pmu_thread_reset(st);
+    pmu_publish_local();
+    hrtimer_start(&st->timer, ms_to_ktime(publish_ms),
+                  HRTIMER_MODE_REL_PINNED);
+    if (pmu_nr_groups() > 1)
+        hrtimer_start(&st->mux_timer, ms_to_ktime(mux_ms),
+                      HRTIMER_MODE_REL_PINNED);
+    if (pmu_interval_ns) {
+        pmu_read_view(st, &st->interval_base);
+        hrtimer_start(&st->interval_timer, ns_to_ktime(pmu_interval_ns),
+                      HRTIMER_MODE_REL_PINNED);
+    }
 }
 
+/* freeze and publish in the same IPI so nothing is counted between the two */
+static void pmu_stop_cpu(void *unused)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+
+    hrtimer_try_to_cancel(&st->mux_timer);
+    pmu_disable_cpu(NULL);
+    hrtimer_try_to_cancel(&st->timer);
+    pmu_publish_local();
+
+    /* the last, partial interval ends at the stop */
+    if (pmu_interval_ns && hrtimer_try_to_cancel(&st->interval_timer) > 0)
+        pmu_interval_emit(st);
+
+    /* a cpu dropped from pmu_cpus must not keep running the probe */
+    st->task_mode = false;
+}
 
+/*
+ * cpus_read_lock keeps cpus from coming or going while the state flips,
+ * so the hotplug callbacks below always see a consistent pmu_state.
+ */
 static void pmu_start_all_cpus(void)
 {
-    on_each_cpu(pmu_reset_cpu, NULL, 1);
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    cpus_read_lock();
+
+    /* offline cpus restart from zero too; nothing else writes their state */
+    for_each_cpu(cpu, &pmu_cpus) {
+        if (cpu_online(cpu))
+            continue;
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        write_seqcount_begin(&st->seq);
+        memset(&st->counts, 0, sizeof(st->counts));
+        memset(&st->retained, 0, sizeof(st->retained));
+        write_seqcount_end(&st->seq);
+    }
+
+    on_each_cpu_mask(&pmu_cpus, pmu_start_cpu, NULL, 1);
     pmu_state = PMU_RUNNING;
+    cpus_read_unlock();
 }
 
 static void pmu_stop_all_cpus(void)
 {
-    on_each_cpu(pmu_disable_cpu, NULL, 1);
+    cpus_read_lock();
+    on_each_cpu_mask(&pmu_cpus, pmu_stop_cpu, NULL, 1);
     pmu_state = PMU_STOPPED;
+    cpus_read_unlock();
 }
 
-static void pmu_read_local(struct pmu_counts *snapshot)
+/*
+ * Read-only EL0 access: mrs of PMCCNTR and PMEVCNTR<n> stops trapping,
+ * writes and PMCR still do. Userspace sees the raw 32-bit event counters,
+ * without the overflow extension kept here.
+ */
+static void pmu_user_access_cpu(void *unused)
 {
-    preempt_disable();
-    snapshot->instructions = read_event_counter(COUNTER_INSTRUCTIONS);
-    snapshot->l1i_ref      = read_event_counter(COUNTER_L1I_REF);
-    snapshot->l1i_miss     = read_event_counter(COUNTER_L1I_MISS);
-    snapshot->l1d_ref      = read_event_counter(COUNTER_L1D_REF);
-    snapshot->l1d_miss     = read_event_counter(COUNTER_L1D_MISS);
-    snapshot->llc_miss     = read_event_counter(COUNTER_LLC_MISS);
-    snapshot->cycles       = read_pmccntr_el0();
-    preempt_enable();
+    write_pmuserenr_el0(READ_ONCE(user_access) ? PMUSERENR_CR | PMUSERENR_ER : 0);
 }
 
-static void pmu_collect_cpu(void *info)
+static void pmu_set_user_access(bool on)
 {
-    struct pmu_counts *per_cpu_counts = info;
-    unsigned int cpu = smp_processor_id();
+    WRITE_ONCE(user_access, on);
+    on_each_cpu(pmu_user_access_cpu, NULL, 1);
+}
+
+/*
+ * Hotplug. A cpu going down stops its counters and publishes their final
+ * value, which stays in its published counts while it is offline. When it
+ * comes back during a run, that value becomes its retained base and the
+ * counters start again on top of it, so totals never go backwards.
+ * Both run on the cpu itself; the syscore hooks do the same for the boot
+ * cpu around suspend, where it is the only one left.
+ */
+static void pmu_cpu_down_local(void)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
 
-    pmu_read_local(&per_cpu_counts[cpu]);
+    if (st->active)
+        pmu_stop_cpu(NULL);
 }
 
+static void pmu_cpu_up_local(unsigned int cpu)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+
+    pmu_user_access_cpu(NULL);
+    if (pmu_state != PMU_RUNNING || !cpumask_test_cpu(cpu, &pmu_cpus))
+        return;
 
+    st->retained = st->counts;
+    pmu_start_cpu(st);
+}
 
-static int pmu_proc_show(struct seq_file *m, void *v)
+static int pmu_cpu_online(unsigned int cpu)
 {
-    struct pmu_counts total = {};
-    struct pmu_counts *per_cpu_counts;
-    unsigned int cpu;
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
 
-    per_cpu_counts = kcalloc(nr_cpu_ids, sizeof(*per_cpu_counts), GFP_KERNEL);
-    if (!per_cpu_counts)
-        return -ENOMEM;
+    local_irq_disable();
+    pmu_cpu_up_local(cpu);
+    local_irq_enable();
+
+    /* the overflow irq was moved away when the cpu went down */
+    if (st->irq > 0)
+        irq_set_affinity(st->irq, cpumask_of(cpu));
+    return 0;
+}
+
+static int pmu_cpu_offline(unsigned int cpu)
+{
+    local_irq_disable();
+    pmu_cpu_down_local();
+    local_irq_enable();
+    return 0;
+}
+
+static int pmu_syscore_suspend(void)
+{
+    pmu_cpu_down_local();
+    return 0;
+}
+
+static void pmu_syscore_resume(void)
+{
+    pmu_cpu_up_local(smp_processor_id());
+}
+
+static struct syscore_ops pmu_syscore_ops = {
+    .suspend = pmu_syscore_suspend,
+    .resume  = pmu_syscore_resume,
+};
+
+static void pmu_find_sched_switch(struct tracepoint *tp, void *priv)
+{
+    if (!strcmp(tp->name, "sched_switch"))
+        pmu_tp_sched_switch = tp;
+}
+
+/* caller holds pmu_ctrl_lock */
+static int pmu_task_attach_probe(void)
+{
+    int ret;
+
+    if (pmu_tp_sched_switch)
+        return 0;
+
+    for_each_kernel_tracepoint(pmu_find_sched_switch, NULL);
+    if (!pmu_tp_sched_switch)
+        return -ENOENT;
+
+    ret = tracepoint_probe_register(pmu_tp_sched_switch,
+                                    pmu_sched_switch_probe, NULL);
+    if (ret)
+        pmu_tp_sched_switch = NULL;
+    return ret;
+}
+
+/* caller holds pmu_ctrl_lock; the probe stays while targets or threads need it */
+static void pmu_task_detach_probe(void)
+{
+    if (!pmu_tp_sched_switch || pmu_target_tgid || pmu_threads_hi)
+        return;
+
+    tracepoint_probe_unregister(pmu_tp_sched_switch,
+                                pmu_sched_switch_probe, NULL);
+    tracepoint_synchronize_unregister();
+    pmu_tp_sched_switch = NULL;
+}
+
+/*
+ * Starting, stopping and reading the counters stay open to everyone, as
+ * /proc/pmu_control always was, and so does targeting one's own processes.
+ * Whatever reaches past that (another user's pid, EL0 counter access, the
+ * event set, the cpus, sampling and interval mode) needs CAP_PERFMON or
+ * CAP_SYS_ADMIN.
+ */
+static bool pmu_may_configure(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+    return perfmon_capable();
+#else
+    return capable(CAP_SYS_ADMIN);
+#endif
+}
+
+/* caller holds pmu_ctrl_lock; pid 0 goes back to system-wide counting */
+static int pmu_set_target(pid_t pid, u32 flags)
+{
+    bool privileged = pmu_may_configure();
+    struct task_struct *task;
+    pid_t tgid = 0;
+    bool allowed;
+    int ret;
+
+    if (flags & ~PMU_TARGET_CHILDREN)
+        return -EINVAL;
+
+    if (pid) {
+        rcu_read_lock();
+        task = pid_task(find_vpid(pid), PIDTYPE_PID);
+        if (task)
+            get_task_struct(task);
+        rcu_read_unlock();
+        if (!task)
+            return -ESRCH;
+
+        /* the same test perf_event_open() applies to a foreign pid */
+        tgid = task->tgid;
+        allowed = privileged ||
+                  ptrace_may_access(task, PTRACE_MODE_READ_REALCREDS);
+        put_task_struct(task);
+        if (!allowed)
+            return -EPERM;
+    }
+
+    pmu_stop_all_cpus();
+
+    WRITE_ONCE(pmu_target_tgid, tgid);
+    WRITE_ONCE(pmu_target_flags, flags);
+    pmu_target_uid = current_uid();
+    WRITE_ONCE(pmu_target_restricted, !privileged);
+
+    if (tgid) {
+        ret = pmu_task_attach_probe();
+        if (ret)
+            goto err;
+    } else {
+        pmu_task_detach_probe();
+    }
+
+    pmu_start_all_cpus();
+    return 0;
+
+err:
+    WRITE_ONCE(pmu_target_tgid, 0);
+    pmu_start_all_cpus();
+    return ret;
+}
+
+static u64 pmu_read_published(unsigned int cpu, struct pmu_counts *counts)
+{
+    struct pmu_cpu_state *st = per_cpu_ptr(&pmu_cpu_state, cpu);
+    unsigned int seq;
+    u64 stamp;
+
+    do {
+        seq = read_seqcount_begin(&st->seq);
+        *counts = st->counts;
+        stamp = st->stamp_ns;
+    } while (read_seqcount_retry(&st->seq, seq));
+
+    return stamp;
+}
+
+
+
+/* caller holds pmu_ctrl_lock, so the cpumask and the event set hold still */
+static void pmu_collect(struct pmu_snapshot *snap)
+{
+    struct pmu_counts *total = &snap->total;
+    struct pmu_counts counts;
+    u64 now = ktime_get_ns();
+    u64 stamp;
+    unsigned int cpu, i;
+
+    memset(snap, 0, sizeof(*snap));
+    snap->state = pmu_state;
+    snap->config = pmu_config;
+    snap->target.pid = READ_ONCE(pmu_target_tgid);
+    snap->target.flags = READ_ONCE(pmu_target_flags);
+
+    /* offline cpus still add what they counted before going down */
+    for_each_cpu(cpu, &pmu_cpus) {
+        stamp = pmu_read_published(cpu, &counts);
+        if (cpu < 64)
+            snap->cpu_mask |= BIT_ULL(cpu);
+
+        for (i = 0; i < snap->config.nr_events; i++) {
+            total->event[i] += counts.event[i];
+            total->time_running[i] += counts.time_running[i];
+        }
+        total->time_enabled += counts.time_enabled;
+        total->cycles += counts.cycles;
+
+        if (cpu < PMU_MAX_CPUS) {
+            pmu_scale_counts(&counts, snap->config.nr_events);
+            snap->cpu[cpu] = counts;
+        }
+
+        /* stopped counters were published by the stop IPI and are exact */
+        if (snap->state == PMU_RUNNING && cpu_online(cpu) && now > stamp)
+            snap->staleness_ns = max_t(u64, snap->staleness_ns, now - stamp);
+    }
+
+    pmu_scale_counts(total, snap->config.nr_events);
+    snap->nr_cpus = min_t(u32, nr_cpu_ids, PMU_MAX_CPUS);
+}
+
+/* caller holds pmu_ctrl_lock */
+static void pmu_stop_collect(struct pmu_snapshot *snap)
+{
+    pmu_stop_all_cpus();
+    pmu_collect(snap);
+}
 
-    on_each_cpu(pmu_collect_cpu, per_cpu_counts, 1);
+static u64 pmu_sample_lost(void)
+{
+    struct pmu_ring_header *ring;
+    unsigned int cpu;
+    u64 lost = 0;
 
-    for_each_online_cpu(cpu) {
-        total.instructions += per_cpu_counts[cpu].instructions;
-        total.l1i_ref      += per_cpu_counts[cpu].l1i_ref;
-        total.l1i_miss     += per_cpu_counts[cpu].l1i_miss;
-        total.l1d_ref      += per_cpu_counts[cpu].l1d_ref;
-        total.l1d_miss     += per_cpu_counts[cpu].l1d_miss;
-        total.llc_miss     += per_cpu_counts[cpu].llc_miss;
-        total.cycles       += per_cpu_counts[cpu].cycles;
+    for_each_possible_cpu(cpu) {
+        ring = per_cpu_ptr(&pmu_cpu_state, cpu)->ring;
+        if (ring)
+            lost += READ_ONCE(ring->lost);
     }
+    return lost;
+}
+
+static int pmu_proc_show(struct seq_file *m, void *v)
+{
+    struct pmu_snapshot *snap;
+    u64 running, enabled;
+    const char *name;
+    unsigned int i;
 
-    kfree(per_cpu_counts);
+    snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
 
-    seq_printf(m, "instructions: %llu\n", total.instructions);
-    seq_printf(m, "l1i_references: %llu\n", total.l1i_ref);
-    seq_printf(m, "l1i_misses: %llu\n", total.l1i_miss);
-    seq_printf(m, "l1d_references: %llu\n", total.l1d_ref);
-    seq_printf(m, "l1d_misses: %llu\n", total.l1d_miss);
-    seq_printf(m, "llc_misses: %llu\n", total.llc_miss);
-    seq_printf(m, "cycles: %llu\n", total.cycles);
+    mutex_lock(&pmu_ctrl_lock);
+    pmu_collect(snap);
+
+    for (i = 0; i < snap->config.nr_events; i++) {
+        name = pmu_event_name(snap->config.event[i]);
+        if (name)
+            seq_printf(m, "%s: %llu", name, snap->total.event[i]);
+        else
+            seq_printf(m, "event_0x%x: %llu", snap->config.event[i],
+                       snap->total.event[i]);
+
+        /* scaled estimate: show how much of the time it was really counted */
+        running = snap->total.time_running[i];
+        enabled = snap->total.time_enabled;
+        if (enabled && running < enabled)
+            seq_printf(m, " (%llu%%)", div64_u64(running * 100, enabled));
+        seq_putc(m, '\n');
+    }
+    seq_printf(m, "cycles: %llu\n", snap->total.cycles);
     seq_printf(m, "state: %s\n",
-               (pmu_state == PMU_RUNNING) ? "running" : "stopped");
+               (snap->state == PMU_RUNNING) ? "running" : "stopped");
+    seq_printf(m, "staleness_ns: %llu\n", snap->staleness_ns);
+    if (strcmp(pmu_ops->name, "armv8"))
+        seq_printf(m, "backend: %s\n", pmu_ops->name);
+    if (snap->target.pid)
+        seq_printf(m, "target: %d%s\n", snap->target.pid,
+                   (snap->target.flags & PMU_TARGET_CHILDREN) ? " children" : "");
+    if (pmu_sample_period) {
+        name = pmu_event_name(pmu_sample_event);
+        if (name)
+            seq_printf(m, "sampling: %s every %u", name, pmu_sample_period);
+        else
+            seq_printf(m, "sampling: event_0x%x every %u", pmu_sample_event,
+                       pmu_sample_period);
+        seq_printf(m, ", lost %llu\n", pmu_sample_lost());
+    }
+    if (!cpumask_equal(&pmu_cpus, cpu_possible_mask))
+        seq_printf(m, "cpumask: %*pbl\n", cpumask_pr_args(&pmu_cpus));
+    if (user_access)
+        seq_puts(m, "user_access: on\n");
+    if (pmu_interval_ns)
+        seq_printf(m, "interval_us: %llu\n",
+                   div64_u64(pmu_interval_ns, NSEC_PER_USEC));
+    mutex_unlock(&pmu_ctrl_lock);
 
+    kfree(snap);
     return 0;
 }
 
@@ -249,79 +1024,1148 @@ static const struct proc_ops pmu_proc_fops = {
     .proc_release = single_release,
 };
 
+/* cycles, then the configured events */
+#define PMU_PERCPU_COLS (PMU_MAX_EVENTS + 1)
 
-
-static ssize_t pmu_ctrl_write(struct file *file,
-                              const char __user *buf,
-                              size_t len, loff_t *ppos)
+static void pmu_percpu_header(struct seq_file *m, u32 nr_events)
 {
-    char kbuf[16];
+    const char *name;
+    u32 i;
+
+    seq_printf(m, "%-10s %14s", "cpu", "cycles");
+    for (i = 0; i < nr_events; i++) {
+        name = pmu_event_name(pmu_config.event[i]);
+        if (name)
+            seq_printf(m, " %14s", name);
+        else
+            seq_printf(m, "     event_0x%02x", pmu_config.event[i]);
+    }
+    seq_putc(m, '\n');
+}
 
-    if (len >= sizeof(kbuf))
-        len = sizeof(kbuf) - 1;
+static void pmu_percpu_row(struct seq_file *m, const char *label,
+                           const u64 *vals, u32 nr_cols)
+{
+    u32 i;
 
-    if (copy_from_user(kbuf, buf, len))
-        return -EFAULT;
+    seq_printf(m, "%-10s", label);
+    for (i = 0; i < nr_cols; i++)
+        seq_printf(m, " %14llu", vals[i]);
+    seq_putc(m, '\n');
+}
 
-    kbuf[len] = '\0';
+/*
+ * One row per counted cpu, the total, and max/mean in percent of every
+ * column: 100 means the cpus did the same amount, 400 with four cpus
+ * means one cpu did everything.
+ */
+static int pmu_percpu_show(struct seq_file *m, void *v)
+{
+    u64 total[PMU_PERCPU_COLS] = { 0 }, peak[PMU_PERCPU_COLS] = { 0 };
+    u64 vals[PMU_PERCPU_COLS];
+    u32 nr_events, nr_cols;
+    struct pmu_counts counts;
+    unsigned int cpu, n = 0;
+    char label[16];
+    u32 i;
 
     mutex_lock(&pmu_ctrl_lock);
-
-    if (!strncmp(kbuf, "1", 1) || !strncmp(kbuf, "start", 5) ||
-        !strncmp(kbuf, "reset", 5)) {
-        pr_info("pmu: start/reset counters\n");
-        pmu_start_all_cpus();
-    } else if (!strncmp(kbuf, "0", 1) || !strncmp(kbuf, "stop", 4) ||
-               !strncmp(kbuf, "pause", 5)) {
-        pr_info("pmu: stop counters\n");
-        pmu_stop_all_cpus();
-    } else {
-        pr_warn("pmu: unknown control command: %s\n", kbuf);
-        mutex_unlock(&pmu_ctrl_lock);
-        return -EINVAL;
+    nr_events = pmu_config.nr_events;
+    nr_cols = nr_events + 1;
+    pmu_percpu_header(m, nr_events);
+
+    for_each_cpu(cpu, &pmu_cpus) {
+        pmu_read_published(cpu, &counts);
+        if (!cpu_online(cpu) && !counts.cycles)
+            continue;
+        pmu_scale_counts(&counts, nr_events);
+
+        vals[0] = counts.cycles;
+        for (i = 0; i < nr_events; i++)
+            vals[i + 1] = counts.event[i];
+        for (i = 0; i < nr_cols; i++) {
+            total[i] += vals[i];
+            peak[i] = max(peak[i], vals[i]);
+        }
+
+        snprintf(label, sizeof(label), cpu_online(cpu) ? "%u" : "%u(off)", cpu);
+        pmu_percpu_row(m, label, vals, nr_cols);
+        n++;
     }
 
+    pmu_percpu_row(m, "total", total, nr_cols);
+
+    for (i = 0; i < nr_cols; i++)
+        vals[i] = total[i] ? div64_u64(peak[i] * 100 * n, total[i]) : 0;
+    pmu_percpu_row(m, "max/mean%", vals, nr_cols);
     mutex_unlock(&pmu_ctrl_lock);
-    return len;
+    return 0;
 }
 
-static const struct proc_ops pmu_ctrl_fops = {
-    .proc_write = pmu_ctrl_write,
+static int pmu_percpu_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, pmu_percpu_show, NULL);
+}
+
+static const struct proc_ops pmu_percpu_fops = {
+    .proc_open    = pmu_percpu_open,
+    .proc_read    = seq_read,
+    .proc_lseek   = seq_lseek,
+    .proc_release = single_release,
 };
 
 
 
-static int __init pmu_init(void)
+/* caller holds pmu_ctrl_lock; the counters restart with the new set */
+static int pmu_set_events(const struct pmu_event_config *config)
 {
-    pr_info("pmu: programming counters for Raspberry Pi 4\n");
+    u32 i;
+
+    if (config->nr_events > PMU_MAX_EVENTS)
+        return -E2BIG;
+
+    for (i = 0; i < config->nr_events; i++) {
+        if (config->event[i] > EVT_CODE_MASK)
+            return -EINVAL;
+    }
 
-    
+    pmu_stop_all_cpus();
+    pmu_config = *config;
     pmu_start_all_cpus();
+    return 0;
+}
 
-    pmu_proc_stats = proc_create(PROC_NAME_STATS, 0444, NULL, &pmu_proc_fops);
-    if (!pmu_proc_stats) {
-        pmu_stop_all_cpus();
-        return -ENOMEM;
+/* rings stay allocated (and mapped) until the module is unloaded */
+static int pmu_alloc_rings(void)
+{
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        if (st->ring)
+            continue;
+
+        st->ring = vmalloc_user((unsigned long)sample_pages << PAGE_SHIFT);
+        if (!st->ring)
+            return -ENOMEM;
+
+        st->ring_nr = ((unsigned long)(sample_pages - 1) << PAGE_SHIFT) /
+                      sizeof(struct pmu_sample);
+        st->ring->nr_records = st->ring_nr;
+        st->ring->record_size = sizeof(struct pmu_sample);
+        st->ring->data_offset = PAGE_SIZE;
     }
+    return 0;
+}
 
-    pmu_proc_ctrl = proc_create(PROC_NAME_CONTROL, 0666, NULL, &pmu_ctrl_fops);
-    if (!pmu_proc_ctrl) {
-        proc_remove(pmu_proc_stats);
-        pmu_stop_all_cpus();
-        return -ENOMEM;
+static void pmu_free_rings(void)
+{
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        vfree(st->ring);
+        st->ring = NULL;
+    }
+}
+
+/*
+ * caller holds pmu_ctrl_lock; the last counter is taken from the groups
+ * while sampling, period 0 gives it back. Needs the overflow irq.
+ */
+static int pmu_set_sampling(u32 event, u32 period)
+{
+    int ret;
+
+    if (period) {
+        if (event > EVT_CODE_MASK)
+            return -EINVAL;
+        if (!pmu_irq_enabled)
+            return -EOPNOTSUPP;
+        if (pmu_nr_counters < 2)
+            return -ENOSPC;
+
+        ret = pmu_alloc_rings();
+        if (ret)
+            return ret;
     }
 
+    pmu_stop_all_cpus();
+    pmu_sample_event = event;
+    pmu_sample_period = period;
+    pmu_sample_counter = pmu_nr_counters - 1;
+    pmu_sample_mask = period ? BIT(pmu_sample_counter) : 0;
+    pmu_start_all_cpus();
+    return 0;
+}
+
+static int pmu_alloc_interval_bufs(void)
+{
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        if (st->iv_buf)
+            continue;
+
+        st->iv_buf = kvcalloc(interval_records, sizeof(*st->iv_buf), GFP_KERNEL);
+        if (!st->iv_buf)
+            return -ENOMEM;
+    }
     return 0;
 }
 
+static void pmu_free_interval_bufs(void)
+{
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        kvfree(st->iv_buf);
+        st->iv_buf = NULL;
+    }
+}
+
+/* caller holds pmu_ctrl_lock; records left from an earlier run stay readable */
+static int pmu_set_interval(u32 us)
+{
+    int ret;
+
+    if (us && (us < PMU_INTERVAL_MIN_US || us > PMU_INTERVAL_MAX_US))
+        return -ERANGE;
+
+    if (us) {
+        ret = pmu_alloc_interval_bufs();
+        if (ret)
+            return ret;
+    }
+
+    pmu_stop_all_cpus();
+    WRITE_ONCE(pmu_interval_ns, (u64)us * NSEC_PER_USEC);
+    pmu_start_all_cpus();
+
+    /* lets a blocked reader see the end of the stream */
+    if (!us)
+        wake_up_interruptible(&pmu_interval_wait);
+    return 0;
+}
+
+/*
+ * caller holds pmu_ctrl_lock. Counters on cpus that leave the mask are
+ * stopped with the rest and stay stopped; their counts no longer add up.
+ */
+static int pmu_set_cpumask(const struct cpumask *mask)
+{
+    if (!cpumask_intersects(mask, cpu_online_mask))
+        return -EINVAL;
+
+    pmu_stop_all_cpus();
+    /* the hotplug callbacks test the mask without pmu_ctrl_lock */
+    cpus_read_lock();
+    cpumask_and(&pmu_cpus, mask, cpu_possible_mask);
+    cpus_read_unlock();
+    pmu_start_all_cpus();
+    return 0;
+}
+
+/* "0-3", "2,3" or "all" */
+static int pmu_parse_cpumask(char *args, struct cpumask *mask)
+{
+    args = strim(args);
+    if (!strcmp(args, "all")) {
+        cpumask_copy(mask, cpu_possible_mask);
+        return 0;
+    }
+    return cpulist_parse(args, mask);
+}
+
+/* "0x08,0x10,l1d_tlb_refill" -> codes; names come from pmu_events.h */
+static int pmu_parse_events(char *list, struct pmu_event_config *config)
+{
+    char *tok;
+    int code;
+
+    config->nr_events = 0;
+
+    while ((tok = strsep(&list, ", \t\n")) != NULL) {
+        if (!*tok)
+            continue;
+        if (config->nr_events >= PMU_MAX_EVENTS)
+            return -E2BIG;
+
+        if (kstrtou32(tok, 0, &config->event[config->nr_events])) {
+            code = pmu_event_code(tok);
+            if (code < 0)
+                return -EINVAL;
+            config->event[config->nr_events] = code;
+        }
+        config->nr_events++;
+    }
+    return 0;
+}
+
+/* "1234", "1234 children" or "0" / "off" for system-wide */
+static int pmu_parse_target(char *args, struct pmu_target *target)
+{
+    char *tok;
+
+    target->pid = 0;
+    target->flags = 0;
+
+    args = skip_spaces(args);
+    tok = strsep(&args, " \t\n");
+    if (!tok || !*tok)
+        return -EINVAL;
+    if (strcmp(tok, "off") && kstrtoint(tok, 10, &target->pid))
+        return -EINVAL;
+    if (target->pid < 0)
+        return -EINVAL;
+
+    if (args) {
+        args = strim(args);
+        if (!strcmp(args, "children"))
+            target->flags |= PMU_TARGET_CHILDREN;
+        else if (*args)
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/* "llc_misses 10000", "0x17 10000" or "off" */
+static int pmu_parse_sampling(char *args, u32 *event, u32 *period)
+{
+    char *tok;
+    int code;
+
+    *event = 0;
+    *period = 0;
+
+    args = skip_spaces(args);
+    tok = strsep(&args, " \t\n");
+    if (!tok || !*tok)
+        return -EINVAL;
+    if (!strcmp(tok, "off"))
+        return 0;
+
+    if (kstrtou32(tok, 0, event)) {
+        code = pmu_event_code(tok);
+        if (code < 0)
+            return -EINVAL;
+        *event = code;
+    }
+
+    if (!args || kstrtou32(strim(args), 0, period) || !*period)
+        return -EINVAL;
+    return 0;
+}
+
+static const char *const pmu_privileged_cmds[] = {
+    "sample", "cpumask", "useraccess", "interval", "events", "readbench",
+};
+
+/*
+ * Mean cost of one pmu_read_local() on the calling cpu, which is what
+ * differs between the armv8 and sim backends. Preemption is only held off
+ * for one batch of reads at a time; the run ends early if the writer was
+ * moved to another cpu in between.
+ */
+#define PMU_READBENCH_MAX   1000000
+#define PMU_READBENCH_BATCH 1000
+
+static void pmu_readbench(u32 n)
+{
+    struct pmu_counts counts;
+    unsigned int cpu = raw_smp_processor_id();
+    u64 start, ns = 0;
+    u32 i, batch, done = 0;
+
+    while (done < n) {
+        batch = min_t(u32, n - done, PMU_READBENCH_BATCH);
+
+        preempt_disable();
+        if (smp_processor_id() != cpu) {
+            preempt_enable();
+            break;
+        }
+        start = ktime_get_ns();
+        for (i = 0; i < batch; i++)
+            pmu_read_local(&counts);
+        ns += ktime_get_ns() - start;
+        preempt_enable();
+
+        done += batch;
+        cond_resched();
+    }
+
+    if (!done) {
+        pr_info("pmu: readbench moved off cpu %u before the first read\n", cpu);
+        return;
+    }
+    pr_info("pmu: %s backend: %llu ns per local read (%u reads on cpu %u)\n",
+            pmu_ops->name, div_u64(ns, done), done, cpu);
+}
+
+static bool pmu_ctrl_privileged(const char *cmd)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(pmu_privileged_cmds); i++) {
+        if (!strncmp(cmd, pmu_privileged_cmds[i],
+                     strlen(pmu_privileged_cmds[i])))
+            return true;
+    }
+    return false;
+}
+
+static ssize_t pmu_ctrl_write(struct file *file,
+                              const char __user *buf,
+                              size_t len, loff_t *ppos)
+{
+    struct pmu_event_config config;
+    struct pmu_target target;
+    struct cpumask mask;
+    u32 event, period, us;
+    char kbuf[256], *args;
+    int ret = 0;
+
+    if (len >= sizeof(kbuf))
+        len = sizeof(kbuf) - 1;
+
+    if (copy_from_user(kbuf, buf, len))
+        return -EFAULT;
+
+    kbuf[len] = '\0';
+
+    if (pmu_ctrl_privileged(kbuf) && !pmu_may_configure())
+        return -EPERM;
+
+    mutex_lock(&pmu_ctrl_lock);
+
+    if (!strncmp(kbuf, "pid", 3)) {
+        ret = pmu_parse_target(kbuf + 3, &target);
+        if (!ret)
+            ret = pmu_set_target(target.pid, target.flags);
+        if (!ret && target.pid)
+            pr_info("pmu: counting pid %d only\n", target.pid);
+    } else if (!strncmp(kbuf, "sample", 6)) {
+        ret = pmu_parse_sampling(kbuf + 6, &event, &period);
+        if (!ret)
+            ret = pmu_set_sampling(event, period);
+        if (!ret && period)
+            pr_info("pmu: sampling event 0x%x every %u\n", event, period);
+    } else if (!strncmp(kbuf, "cpumask", 7)) {
+        ret = pmu_parse_cpumask(kbuf + 7, &mask);
+        if (!ret)
+            ret = pmu_set_cpumask(&mask);
+        if (!ret)
+            pr_info("pmu: counting cpus %*pbl\n", cpumask_pr_args(&pmu_cpus));
+    } else if (!strncmp(kbuf, "useraccess", 10)) {
+        args = strim(kbuf + 10);
+        if (!strcmp(args, "on") || !strcmp(args, "1"))
+            pmu_set_user_access(true);
+        else if (!strcmp(args, "off") || !strcmp(args, "0"))
+            pmu_set_user_access(false);
+        else
+            ret = -EINVAL;
+    } else if (!strncmp(kbuf, "readbench", 9)) {
+        if (kstrtou32(strim(kbuf + 9), 0, &us) || !us || us > PMU_READBENCH_MAX)
+            ret = -EINVAL;
+        else
+            pmu_readbench(us);
+    } else if (!strncmp(kbuf, "interval", 8)) {
+        args = strim(kbuf + 8);
+        us = 0;
+        if (strcmp(args, "off") && kstrtou32(args, 0, &us))
+            ret = -EINVAL;
+        if (!ret)
+            ret = pmu_set_interval(us);
+        if (!ret && us)
+            pr_info("pmu: interval records every %u us\n", us);
+    } else if (!strncmp(kbuf, "events", 6)) {
+        ret = pmu_parse_events(kbuf + 6, &config);
+        if (!ret)
+            ret = pmu_set_events(&config);
+        if (!ret)
+            pr_info("pmu: counting %u events\n", config.nr_events);
+    } else if (!strncmp(kbuf, "1", 1) || !strncmp(kbuf, "start", 5) ||
+               !strncmp(kbuf, "reset", 5)) {
+        pr_info("pmu: start/reset counters\n");
+        pmu_start_all_cpus();
+    } else if (!strncmp(kbuf, "0", 1) || !strncmp(kbuf, "stop", 4) ||
+               !strncmp(kbuf, "pause", 5)) {
+        pr_info("pmu: stop counters\n");
+        pmu_stop_all_cpus();
+    } else {
+        pr_warn("pmu: unknown control command: %s\n", kbuf);
+        ret = -EINVAL;
+    }
+
+    mutex_unlock(&pmu_ctrl_lock);
+    return ret ? ret : len;
+}
+
+static const struct proc_ops pmu_ctrl_fops = {
+    .proc_write = pmu_ctrl_write,
+};
+
+
+
+static long pmu_ioctl_snapshot(unsigned long arg, bool stop)
+{
+    struct pmu_snapshot *snap;
+    long ret = 0;
+
+    snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+
+    mutex_lock(&pmu_ctrl_lock);
+    if (stop)
+        pmu_stop_collect(snap);
+    else
+        pmu_collect(snap);
+    mutex_unlock(&pmu_ctrl_lock);
+
+    if (copy_to_user((void __user *)arg, snap, sizeof(*snap)))
+        ret = -EFAULT;
+
+    kfree(snap);
+    return ret;
+}
+
+/*
+ * Wait until no probe can still be updating the cleared slots, then let
+ * them be reused. Caller holds pmu_ctrl_lock.
+ */
+static void pmu_thread_free_cleared(void)
+{
+    unsigned int i, hi = 0;
+
+    synchronize_rcu();
+    for (i = 0; i < pmu_threads_hi; i++) {
+        if (pmu_threads[i].file && !pmu_threads[i].task)
+            pmu_threads[i].file = NULL;
+        if (pmu_threads[i].file)
+            hi = i + 1;
+    }
+    WRITE_ONCE(pmu_threads_hi, hi);
+}
+
+/* caller holds pmu_ctrl_lock */
+static void pmu_thread_clear(struct pmu_thread_slot *t)
+{
+    struct task_struct *task = t->task;
+
+    WRITE_ONCE(t->task, NULL);
+    put_task_struct(task);
+}
+
+/*
+ * A slot for current that starts counting now, or NULL when all are
+ * taken; those of exited threads are reclaimed first.
+ */
+static struct pmu_thread_slot *pmu_thread_alloc(struct file *file)
+{
+    struct pmu_thread_slot *t = NULL;
+    bool reclaimed = false;
+    struct pmu_counts now;
+    unsigned long flags;
+    unsigned int i, j;
+
+    mutex_lock(&pmu_ctrl_lock);
+    for (;;) {
+        for (i = 0; i < PMU_THREADS_MAX; i++) {
+            if (!pmu_threads[i].file) {
+                t = &pmu_threads[i];
+                break;
+            }
+        }
+        if (t || reclaimed)
+            break;
+
+        for (j = 0; j < pmu_threads_hi; j++) {
+            if (pmu_threads[j].task && pmu_threads[j].task->exit_state) {
+                pmu_thread_clear(&pmu_threads[j]);
+                reclaimed = true;
+            }
+        }
+        if (!reclaimed)
+            break;
+        pmu_thread_free_cleared();
+    }
+    if (!t || pmu_task_attach_probe()) {
+        mutex_unlock(&pmu_ctrl_lock);
+        return NULL;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->file = file;
+    get_task_struct(current);
+
+    local_irq_save(flags);
+    pmu_read_local(&now);
+    pmu_thread_in(this_cpu_ptr(&pmu_cpu_state), t, &now);
+    smp_store_release(&t->task, current);
+    if (i >= pmu_threads_hi)
+        WRITE_ONCE(pmu_threads_hi, i + 1);
+    local_irq_restore(flags);
+
+    mutex_unlock(&pmu_ctrl_lock);
+    return t;
+}
+
+static int pmu_dev_release(struct inode *inode, struct file *file)
+{
+    bool cleared = false;
+    unsigned int i;
+
+    mutex_lock(&pmu_ctrl_lock);
+    for (i = 0; i < pmu_threads_hi; i++) {
+        if (pmu_threads[i].file == file && pmu_threads[i].task) {
+            pmu_thread_clear(&pmu_threads[i]);
+            cleared = true;
+        }
+    }
+    if (cleared) {
+        pmu_thread_free_cleared();
+        pmu_task_detach_probe();
+    }
+    mutex_unlock(&pmu_ctrl_lock);
+    return 0;
+}
+
+static long pmu_ioctl_snapshot_local(struct file *file, unsigned long arg)
+{
+    struct pmu_thread_slot *t = pmu_thread_find(current, file);
+    struct pmu_local_snapshot snap;
+    struct pmu_cpu_state *st;
+    unsigned long flags;
+
+    if (!t)
+        t = pmu_thread_alloc(file);
+
+    memset(&snap, 0, sizeof(snap));
+
+    local_irq_save(flags);
+    st = this_cpu_ptr(&pmu_cpu_state);
+    snap.cpu = smp_processor_id();
+    snap.active = st->active;
+    pmu_read_local(&snap.counts);
+    snap.switches = current->nvcsw + current->nivcsw;
+    if (t) {
+        snap.tracked = 1;
+        pmu_thread_view(st, t, &snap.counts, &snap.thread, &snap.restarts);
+    }
+    local_irq_restore(flags);
+
+    if (copy_to_user((void __user *)arg, &snap, sizeof(snap)))
+        return -EFAULT;
+    return 0;
+}
+
+static long pmu_ioctl_set_events(unsigned long arg)
+{
+    struct pmu_event_config config;
+    long ret;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+        return -EFAULT;
+
+    mutex_lock(&pmu_ctrl_lock);
+    ret = pmu_set_events(&config);
+    mutex_unlock(&pmu_ctrl_lock);
+    return ret;
+}
+
+static long pmu_ioctl_set_target(unsigned long arg)
+{
+    struct pmu_target target;
+    long ret;
+
+    if (copy_from_user(&target, (void __user *)arg, sizeof(target)))
+        return -EFAULT;
+    if (target.pid < 0)
+        return -EINVAL;
+
+    mutex_lock(&pmu_ctrl_lock);
+    ret = pmu_set_target(target.pid, target.flags);
+    mutex_unlock(&pmu_ctrl_lock);
+    return ret;
+}
+
+static long pmu_ioctl_set_sampling(unsigned long arg)
+{
+    struct pmu_sample_config config;
+    long ret;
+
+    if (copy_from_user(&config, (void __user *)arg, sizeof(config)))
+        return -EFAULT;
+
+    mutex_lock(&pmu_ctrl_lock);
+    ret = pmu_set_sampling(config.event, config.period);
+    mutex_unlock(&pmu_ctrl_lock);
+    if (ret)
+        return ret;
+
+    config.ring_pages = sample_pages;
+    config.nr_cpus = nr_cpu_ids;
+    if (copy_to_user((void __user *)arg, &config, sizeof(config)))
+        return -EFAULT;
+    return 0;
+}
+
+static long pmu_ioctl_set_interval(unsigned long arg)
+{
+    u32 us;
+    long ret;
+
+    if (get_user(us, (u32 __user *)arg))
+        return -EFAULT;
+
+    mutex_lock(&pmu_ctrl_lock);
+    ret = pmu_set_interval(us);
+    mutex_unlock(&pmu_ctrl_lock);
+    return ret;
+}
+
+static long pmu_ioctl_set_cpumask(unsigned long arg)
+{
+    struct cpumask mask;
+    unsigned int cpu;
+    long ret;
+    u64 bits;
+
+    if (get_user(bits, (u64 __user *)arg))
+        return -EFAULT;
+
+    if (!bits) {
+        cpumask_copy(&mask, cpu_possible_mask);
+    } else {
+        cpumask_clear(&mask);
+        for (cpu = 0; cpu < 64 && cpu < nr_cpu_ids; cpu++) {
+            if (bits & BIT_ULL(cpu))
+                cpumask_set_cpu(cpu, &mask);
+        }
+    }
+
+    mutex_lock(&pmu_ctrl_lock);
+    ret = pmu_set_cpumask(&mask);
+    mutex_unlock(&pmu_ctrl_lock);
+    return ret;
+}
+
+static long pmu_dev_ioctl(struct file *file, unsigned int cmd,
+                          unsigned long arg)
+{
+    switch (cmd) {
+    case PMU_IOC_SET_EVENTS:
+    case PMU_IOC_SET_SAMPLING:
+    case PMU_IOC_SET_INTERVAL:
+    case PMU_IOC_SET_CPUMASK:
+        if (!pmu_may_configure())
+            return -EPERM;
+        break;
+    }
+
+    switch (cmd) {
+    case PMU_IOC_SNAPSHOT:
+        return pmu_ioctl_snapshot(arg, false);
+    case PMU_IOC_STOP_SNAPSHOT:
+        return pmu_ioctl_snapshot(arg, true);
+    case PMU_IOC_START:
+        mutex_lock(&pmu_ctrl_lock);
+        pmu_start_all_cpus();
+        mutex_unlock(&pmu_ctrl_lock);
+        return 0;
+    case PMU_IOC_STOP:
+        mutex_lock(&pmu_ctrl_lock);
+        pmu_stop_all_cpus();
+        mutex_unlock(&pmu_ctrl_lock);
+        return 0;
+    case PMU_IOC_SET_EVENTS:
+        return pmu_ioctl_set_events(arg);
+    case PMU_IOC_SET_TARGET:
+        return pmu_ioctl_set_target(arg);
+    case PMU_IOC_SET_SAMPLING:
+        return pmu_ioctl_set_sampling(arg);
+    case PMU_IOC_SET_INTERVAL:
+        return pmu_ioctl_set_interval(arg);
+    case PMU_IOC_SET_CPUMASK:
+        return pmu_ioctl_set_cpumask(arg);
+    case PMU_IOC_SNAPSHOT_LOCAL:
+        return pmu_ioctl_snapshot_local(file, arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static bool pmu_interval_pending(void)
+{
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        if (st->iv_buf && smp_load_acquire(&st->iv_head) != st->iv_tail)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Whole struct pmu_interval records, oldest first per cpu. Blocks until
+ * one is there; returns 0 (end of stream) once interval mode is off and
+ * everything was read.
+ */
+static ssize_t pmu_dev_read(struct file *file, char __user *buf,
+                            size_t len, loff_t *ppos)
+{
+    struct pmu_interval __user *out = (struct pmu_interval __user *)buf;
+    size_t max = len / sizeof(struct pmu_interval);
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+    size_t done = 0;
+    u64 head, tail;
+    int ret;
+
+    if (!pmu_may_configure())
+        return -EPERM;
+    if (!max)
+        return -EINVAL;
+
+    for (;;) {
+        if (pmu_interval_pending())
+            break;
+        if (!READ_ONCE(pmu_interval_ns))
+            return 0;
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        ret = wait_event_interruptible(pmu_interval_wait,
+                                       pmu_interval_pending() ||
+                                       !READ_ONCE(pmu_interval_ns));
+        if (ret)
+            return ret;
+    }
+
+    mutex_lock(&pmu_interval_read_lock);
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        if (!st->iv_buf)
+            continue;
+
+        head = smp_load_acquire(&st->iv_head);
+        for (tail = st->iv_tail; tail != head && done < max; tail++, done++) {
+            if (copy_to_user(&out[done], &st->iv_buf[tail % interval_records],
+                             sizeof(*out))) {
+                smp_store_release(&st->iv_tail, tail);
+                mutex_unlock(&pmu_interval_read_lock);
+                return done ? done * sizeof(*out) : -EFAULT;
+            }
+        }
+        smp_store_release(&st->iv_tail, tail);
+    }
+    mutex_unlock(&pmu_interval_read_lock);
+
+    return done * sizeof(*out);
+}
+
+static __poll_t pmu_dev_poll(struct file *file, poll_table *wait)
+{
+    if (!pmu_may_configure())
+        return EPOLLERR;
+
+    poll_wait(file, &pmu_interval_wait, wait);
+    return pmu_interval_pending() ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/* offset cpu * sample_pages pages maps the sample ring of that cpu */
+static int pmu_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long cpu = vma->vm_pgoff / sample_pages;
+    struct pmu_ring_header *ring;
+
+    if (!pmu_may_configure())
+        return -EPERM;
+    if (vma->vm_pgoff % sample_pages ||
+        size != (unsigned long)sample_pages << PAGE_SHIFT)
+        return -EINVAL;
+    if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+        return -ENXIO;
+
+    mutex_lock(&pmu_ctrl_lock);
+    ring = per_cpu_ptr(&pmu_cpu_state, cpu)->ring;
+    mutex_unlock(&pmu_ctrl_lock);
+    if (!ring)
+        return -ENODATA;
+
+    return remap_vmalloc_range(vma, ring, 0);
+}
+
+static const struct file_operations pmu_dev_fops = {
+    .owner          = THIS_MODULE,
+    .release        = pmu_dev_release,
+    .read           = pmu_dev_read,
+    .poll           = pmu_dev_poll,
+    .unlocked_ioctl = pmu_dev_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap           = pmu_dev_mmap,
+};
+
+static struct miscdevice pmu_miscdev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name  = PMU_DEV_NAME,
+    .fops  = &pmu_dev_fops,
+    .mode  = 0666,
+};
+
+
+
+static void pmu_init_cpu_state(void)
+{
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    if (!publish_ms)
+        publish_ms = 1;
+    if (!mux_ms)
+        mux_ms = 1;
+    if (sample_pages < 2)
+        sample_pages = 2;
+    if (!interval_records)
+        interval_records = 1;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        seqcount_init(&st->seq);
+        hrtimer_init(&st->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+        st->timer.function = pmu_publish_timer_fn;
+        hrtimer_init(&st->mux_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+        st->mux_timer.function = pmu_mux_timer_fn;
+        hrtimer_init(&st->interval_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED);
+        st->interval_timer.function = pmu_interval_timer_fn;
+    }
+}
+
+static void pmu_irq_disable_cpu(void *unused)
+{
+    write_pmintenclr_el1(~0U);
+}
+
+static const struct of_device_id pmu_of_match[] = {
+    { .compatible = "arm,cortex-a72-pmu" },
+    { .compatible = "arm,armv8-pmuv3" },
+    { }
+};
+
+static void pmu_free_irqs(void)
+{
+    struct pmu_cpu_state *st;
+    unsigned int cpu;
+
+    if (pmu_irq_enabled)
+        on_each_cpu(pmu_irq_disable_cpu, NULL, 1);
+    pmu_irq_enabled = false;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        if (st->irq > 0)
+            free_irq(st->irq, st);
+        st->irq = 0;
+    }
+}
+
+/*
+ * The Pi 4 wires one SPI per core ("interrupt-affinity" in the DT).
+ * If perf's arm_pmu driver already owns them, request_irq fails and the
+ * publish timer keeps doing the folding instead.
+ */
+static int pmu_request_irqs(void)
+{
+    struct device_node *np, *cpu_np;
+    struct pmu_cpu_state *st;
+    int i, irq, cpu, ret = -ENODEV;
+
+    np = of_find_matching_node(NULL, pmu_of_match);
+    if (!np)
+        return -ENODEV;
+
+    for (i = 0; (irq = irq_of_parse_and_map(np, i)) > 0; i++) {
+        cpu_np = of_parse_phandle(np, "interrupt-affinity", i);
+        cpu = cpu_np ? of_cpu_node_to_id(cpu_np) : i;
+        of_node_put(cpu_np);
+
+        if (cpu < 0 || cpu >= nr_cpu_ids) {
+            ret = -EINVAL;
+            goto err;
+        }
+
+        st = per_cpu_ptr(&pmu_cpu_state, cpu);
+        ret = request_irq(irq, pmu_overflow_irq,
+                          IRQF_NOBALANCING | IRQF_NO_THREAD,
+                          "pmu-overflow", st);
+        if (ret)
+            goto err;
+
+        st->irq = irq;
+        irq_set_affinity(irq, cpumask_of(cpu));
+    }
+
+    of_node_put(np);
+    if (!i)
+        return -ENODEV;
+
+    /* the start IPI sets PMINTENSET for whatever group it programs */
+    pmu_irq_enabled = true;
+    return 0;
+
+err:
+    of_node_put(np);
+    pmu_free_irqs();
+    return ret;
+}
+
+static void pmu_cancel_timers(void)
+{
+    unsigned int cpu;
+
+    for_each_possible_cpu(cpu) {
+        hrtimer_cancel(&per_cpu_ptr(&pmu_cpu_state, cpu)->interval_timer);
+        hrtimer_cancel(&per_cpu_ptr(&pmu_cpu_state, cpu)->mux_timer);
+        hrtimer_cancel(&per_cpu_ptr(&pmu_cpu_state, cpu)->timer);
+    }
+}
+
+static int pmu_init_backend(void)
+{
+    pmu_ops = pmu_backend_find(backend);
+    if (!pmu_ops) {
+        pr_err("pmu: unknown backend %s\n", backend);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int pmu_init_events(void)
+{
+    int i;
+
+    pmu_nr_counters = (read_pmcr_el0() >> PMCR_N_SHIFT) & PMCR_N_MASK;
+
+    if (param_nr_events) {
+        pmu_config.nr_events = param_nr_events;
+        for (i = 0; i < param_nr_events; i++) {
+            if (param_events[i] > EVT_CODE_MASK)
+                return -EINVAL;
+            pmu_config.event[i] = param_events[i];
+        }
+    }
+
+    if (!pmu_nr_counters) {
+        pr_err("pmu: no event counters implemented\n");
+        return -ENODEV;
+    }
+
+    if (pmu_config.nr_events > pmu_nr_counters)
+        pr_info("pmu: %u events on %u counters, multiplexing every %u ms\n",
+                pmu_config.nr_events, pmu_nr_counters, mux_ms);
+    return 0;
+}
+
+static int __init pmu_init(void)
+{
+    int ret;
+
+    ret = pmu_init_backend();
+    if (ret)
+        return ret;
+
+    pr_info("pmu: programming counters for Raspberry Pi 4 (%s backend)\n",
+            pmu_ops->name);
+
+    ret = pmu_init_events();
+    if (ret)
+        return ret;
+
+    ret = -ENOMEM;
+    pmu_init_cpu_state();
+    cpumask_copy(&pmu_cpus, cpu_possible_mask);
+
+    if (use_irq && pmu_ops->has_irq && pmu_request_irqs())
+        pr_info("pmu: overflow irq unavailable, extending counters from the publish timer\n");
+
+    ret = cpuhp_setup_state_nocalls(CPUHP_AP_ONLINE_DYN, "pmu/part3:online",
+                                    pmu_cpu_online, pmu_cpu_offline);
+    if (ret < 0)
+        goto err_irqs;
+    pmu_hp_state = ret;
+    register_syscore_ops(&pmu_syscore_ops);
+
+    ret = -ENOMEM;
+    pmu_start_all_cpus();
+    if (user_access)
+        pmu_set_user_access(true);
+
+    pmu_proc_stats = proc_create(PROC_NAME_STATS, 0444, NULL, &pmu_proc_fops);
+    if (!pmu_proc_stats)
+        goto err_stop;
+
+    pmu_proc_ctrl = proc_create(PROC_NAME_CONTROL, 0666, NULL, &pmu_ctrl_fops);
+    if (!pmu_proc_ctrl)
+        goto err_stats;
+
+    pmu_proc_percpu = proc_create(PROC_NAME_PERCPU, 0444, NULL, &pmu_percpu_fops);
+    if (!pmu_proc_percpu)
+        goto err_ctrl;
+
+    ret = misc_register(&pmu_miscdev);
+    if (ret)
+        goto err_percpu;
+
+    return 0;
+
+err_percpu:
+    proc_remove(pmu_proc_percpu);
+err_ctrl:
+    proc_remove(pmu_proc_ctrl);
+err_stats:
+    proc_remove(pmu_proc_stats);
+err_stop:
+    unregister_syscore_ops(&pmu_syscore_ops);
+    cpuhp_remove_state_nocalls(pmu_hp_state);
+    pmu_stop_all_cpus();
+    pmu_set_user_access(false);
+    pmu_cancel_timers();
+err_irqs:
+    pmu_free_irqs();
+    return ret;
+}
+
 static void __exit pmu_exit(void)
 {
+    misc_deregister(&pmu_miscdev);
+    if (pmu_proc_percpu)
+        proc_remove(pmu_proc_percpu);
     if (pmu_proc_ctrl)
         proc_remove(pmu_proc_ctrl);
     if (pmu_proc_stats)
         proc_remove(pmu_proc_stats);
 
+    unregister_syscore_ops(&pmu_syscore_ops);
+    cpuhp_remove_state_nocalls(pmu_hp_state);
     pmu_stop_all_cpus();
+    pmu_set_user_access(false);
+    pmu_target_tgid = 0;
+    pmu_task_detach_probe();
+    pmu_cancel_timers();
+    pmu_free_irqs();
+    pmu_free_rings();
+    pmu_free_interval_bufs();
     pr_info("pmu: module unloaded\n");
 }
 
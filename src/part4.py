@@ -15,6 +15,12 @@ def run_program(cmd):
     return out
 
 
+def parse_count(line):
+    # "n/a": the perf backend could not count this event on the host
+    value = line.split(":")[1].strip()
+    return int(value) if value.isdigit() else pd.NA
+
+
 def parse_pmu_output(text):
     stats = {}
     current_label = None
@@ -33,19 +39,24 @@ def parse_pmu_output(text):
 
         if current_label:
             if line.startswith("instructions"):
-                stats[current_label]["instructions"] = int(line.split(":")[1])
+                stats[current_label]["instructions"] = parse_count(line)
             elif line.startswith("l1i_ref"):
-                stats[current_label]["l1i_ref"] = int(line.split(":")[1])
+                stats[current_label]["l1i_ref"] = parse_count(line)
             elif line.startswith("l1i_miss"):
-                stats[current_label]["l1i_miss"] = int(line.split(":")[1])
+                stats[current_label]["l1i_miss"] = parse_count(line)
             elif line.startswith("l1d_ref"):
-                stats[current_label]["l1d_ref"] = int(line.split(":")[1])
+                stats[current_label]["l1d_ref"] = parse_count(line)
             elif line.startswith("l1d_miss"):
-                stats[current_label]["l1d_miss"] = int(line.split(":")[1])
+                stats[current_label]["l1d_miss"] = parse_count(line)
             elif line.startswith("llc_miss"):
-                stats[current_label]["llc_miss"] = int(line.split(":")[1])
+                stats[current_label]["llc_miss"] = parse_count(line)
             elif line.startswith("cycles"):
-                stats[current_label]["cycles"] = int(line.split(":")[1])
+                stats[current_label]["cycles"] = parse_count(line)
+            elif " : " in line:
+                # events reprogrammed through "events ..." on /proc/pmu_control
+                key, value = line.split(" : ", 1)
+                if value.strip().isdigit():
+                    stats[current_label][key.strip()] = int(value)
 
         i += 1
 
@@ -1,166 +1,992 @@
-
-
-
-
 #define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <fcntl.h>
 
-#define PMU_CTRL_PATH  "/proc/pmu_control"
-#define PMU_STATS_PATH "/proc/pmu_stats"
+/* float64x2_t is AArch64 only */
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MM_NEON 1
+#endif
 
-#define N 512
+#include "bench_alloc.h"
+#include "libpmu.h"
+#include "pmu_fast.h"
 
-struct pmu_stats {
-    unsigned long long instructions;
-    unsigned long long l1i_ref;
-    unsigned long long l1i_miss;
-    unsigned long long l1d_ref;
-    unsigned long long l1d_miss;
-    unsigned long long llc_miss;
-    unsigned long long cycles;
+/*
+ * Matrix multiplication phases, one per kernel:
+ *
+ *   matrix_phases [-k naive,ikj,transposed,tiled,neon] [-t tile] [-n size]
+ *   matrix_phases -s 32:2048:2 [-w warmup] [-r repeat] [-o sweep.csv] ...
+ *   matrix_phases -T 4 [-n size] [-t tile]
+ *   matrix_phases -F 1000 -n 32 [-k kernel,...]
+ *
+ * naive is the original i-j-k loop. ikj streams rows of B and C,
+ * transposed multiplies by a transposed copy of B so both operands are
+ * read along rows, and tiled runs i-k-j on tile x tile blocks. neon is
+ * a 4x4 register-blocked micro-kernel on the same k tiles (plain C with
+ * the same blocking where there is no NEON). Every phase is checked
+ * against a reference product and reports GFLOP/s, IPC and miss rates.
+ *
+ * With -s the phases are replaced by a size sweep that writes one CSV row
+ * per size, kernel and repeat, see run_sweep(). -T runs the scaling
+ * table of run_scaling() instead, and -F compares the EL0 counter reads
+ * of pmu_fast.h with the ioctl on short multiplies, see run_fast().
+ *
+ * -a picks how the matrices are allocated (see bench_alloc.h). Any -a,
+ * malloc included, swaps the L1I events for the L1D and L2D TLB refills so
+ * every policy counts the same six; the old events are put back at exit.
+ */
+
+#define DEFAULT_N    512
+#define MAX_SIZES    64
+
+struct kernel {
+    const char *name;
+    void (*fn)(const double *A, const double *B, double *C, int n);
 };
 
-static int pmu_control(const char *cmd)
+static int tile = 64;
+static double *Bt;     /* scratch for the transposed kernel */
+
+static void print_stats(const char *label, const struct pmu_snapshot *snap)
 {
-    int fd = open(PMU_CTRL_PATH, O_WRONLY);
-    if (fd < 0) {
-        perror("open pmu_control");
-        return -1;
+    const char *name;
+    unsigned int i;
+
+    printf("==== PMU statistics for %s ====\n", label);
+    for (i = 0; i < snap->config.nr_events; i++) {
+        name = pmu_event_name(snap->config.event[i]);
+        if (name)
+            printf("%-12s : ", name);
+        else
+            printf("event_0x%02x   : ", snap->config.event[i]);
+        if (pmu_counted(&snap->total, i))
+            printf("%llu\n", snap->total.event[i]);
+        else
+            printf("n/a\n");
     }
-    ssize_t len = strlen(cmd);
-    if (write(fd, cmd, len) != len) {
-        perror("write pmu_control");
-        close(fd);
-        return -1;
+    printf("cycles       : %llu\n\n", snap->total.cycles);
+}
+
+/* derived figures on a line part4.py skips; llc is per L1D access like there */
+static void print_rates(const struct pmu_snapshot *snap, double flops,
+                        double seconds)
+{
+    const struct pmu_counts *t = &snap->total;
+    double instr = pmu_count(snap, t, EVT_INSTR_RETIRED);
+    double l1d = pmu_count(snap, t, EVT_L1D_ACCESS);
+    double l1d_miss = pmu_count(snap, t, EVT_L1D_REFILL);
+    double llc_miss = pmu_count(snap, t, EVT_LLC_REFILL);
+
+    printf("  -> %.3f GFLOP/s in %.3f s, IPC %.2f, L1D miss %.2f%%, LLC miss %.3f%%\n\n",
+           flops / seconds / 1e9, seconds,
+           t->cycles ? instr / t->cycles : 0.0,
+           l1d ? 100.0 * l1d_miss / l1d : 0.0,
+           l1d ? 100.0 * llc_miss / l1d : 0.0);
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void mm_naive(const double *A, const double *B, double *C, int n)
+{
+    int i, j, k;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            double sum = 0.0;
+            for (k = 0; k < n; k++) {
+                sum += A[i * n + k] * B[k * n + j];
+            }
+            C[i * n + j] = sum;
+        }
     }
-    close(fd);
-    return 0;
 }
 
-static int pmu_read_stats(struct pmu_stats *s)
+static void mm_ikj(const double *A, const double *B, double *C, int n)
 {
-    char buf[512];
-    int fd = open(PMU_STATS_PATH, O_RDONLY);
-    if (fd < 0) {
-        perror("open pmu_stats");
-        return -1;
+    int i, j, k;
+
+    memset(C, 0, (size_t)n * n * sizeof(double));
+    for (i = 0; i < n; i++) {
+        for (k = 0; k < n; k++) {
+            double a = A[i * n + k];
+            for (j = 0; j < n; j++)
+                C[i * n + j] += a * B[k * n + j];
+        }
     }
+}
 
-    ssize_t n = read(fd, buf, sizeof(buf) - 1);
-    if (n <= 0) {
-        perror("read pmu_stats");
-        close(fd);
-        return -1;
+/* the transpose is part of the phase, it is what the layout costs */
+static void mm_transposed(const double *A, const double *B, double *C, int n)
+{
+    int i, j, k;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++)
+            Bt[j * n + i] = B[i * n + j];
     }
-    buf[n] = '\0';
-    close(fd);
-
-    int matched = sscanf(buf,
-                         "instructions: %llu\n"
-                         "l1i_references: %llu\n"
-                         "l1i_misses: %llu\n"
-                         "l1d_references: %llu\n"
-                         "l1d_misses: %llu\n"
-                         "llc_misses: %llu\n"
-                         "cycles: %llu",
-                         &s->instructions,
-                         &s->l1i_ref,
-                         &s->l1i_miss,
-                         &s->l1d_ref,
-                         &s->l1d_miss,
-                         &s->llc_miss,
-                         &s->cycles);
-
-    if (matched != 7) {
-        fprintf(stderr, "Failed to parse pmu_stats (matched=%d)\n", matched);
-        return -1;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            double sum = 0.0;
+            for (k = 0; k < n; k++)
+                sum += A[i * n + k] * Bt[j * n + k];
+            C[i * n + j] = sum;
+        }
     }
-    return 0;
 }
 
-static void print_stats(const char *label, const struct pmu_stats *s)
+static int min_int(int a, int b)
 {
-    printf("==== PMU statistics for %s ====\n", label);
-    printf("instructions : %llu\n", s->instructions);
-    printf("l1i_ref      : %llu\n", s->l1i_ref);
-    printf("l1i_miss     : %llu\n", s->l1i_miss);
-    printf("l1d_ref      : %llu\n", s->l1d_ref);
-    printf("l1d_miss     : %llu\n", s->l1d_miss);
-    printf("llc_miss     : %llu\n", s->llc_miss);
-    printf("cycles       : %llu\n\n", s->cycles);
+    return a < b ? a : b;
 }
 
-int main(void)
+static void mm_tiled(const double *A, const double *B, double *C, int n)
 {
-    double *A, *B, *C;
-    struct pmu_stats init_stats, mm_stats;
-    long long checksum = 0;
-    int i, j, k;
+    int ii, jj, kk, i, j, k;
+
+    memset(C, 0, (size_t)n * n * sizeof(double));
+    for (ii = 0; ii < n; ii += tile) {
+        for (kk = 0; kk < n; kk += tile) {
+            for (jj = 0; jj < n; jj += tile) {
+                for (i = ii; i < min_int(ii + tile, n); i++) {
+                    for (k = kk; k < min_int(kk + tile, n); k++) {
+                        double a = A[i * n + k];
+                        for (j = jj; j < min_int(jj + tile, n); j++)
+                            C[i * n + j] += a * B[k * n + j];
+                    }
+                }
+            }
+        }
+    }
+}
+
+/* C[i..i+3][j..j+3] += A[i..i+3][k0..k1) * B[k0..k1)[j..j+3] */
+static void mm_block4x4(const double *A, const double *B, double *C, int n,
+                        int i, int j, int k0, int k1)
+{
+    int r, k;
+#ifdef MM_NEON
+    float64x2_t acc[4][2];
+
+    for (r = 0; r < 4; r++) {
+        acc[r][0] = vld1q_f64(&C[(i + r) * n + j]);
+        acc[r][1] = vld1q_f64(&C[(i + r) * n + j + 2]);
+    }
+    for (k = k0; k < k1; k++) {
+        float64x2_t b0 = vld1q_f64(&B[k * n + j]);
+        float64x2_t b1 = vld1q_f64(&B[k * n + j + 2]);
+
+        for (r = 0; r < 4; r++) {
+            double a = A[(i + r) * n + k];
+
+            acc[r][0] = vfmaq_n_f64(acc[r][0], b0, a);
+            acc[r][1] = vfmaq_n_f64(acc[r][1], b1, a);
+        }
+    }
+    for (r = 0; r < 4; r++) {
+        vst1q_f64(&C[(i + r) * n + j], acc[r][0]);
+        vst1q_f64(&C[(i + r) * n + j + 2], acc[r][1]);
+    }
+#else
+    double acc[4][4];
+    int c;
+
+    for (r = 0; r < 4; r++) {
+        for (c = 0; c < 4; c++)
+            acc[r][c] = C[(i + r) * n + j + c];
+    }
+    for (k = k0; k < k1; k++) {
+        for (r = 0; r < 4; r++) {
+            double a = A[(i + r) * n + k];
+
+            for (c = 0; c < 4; c++)
+                acc[r][c] += a * B[k * n + j + c];
+        }
+    }
+    for (r = 0; r < 4; r++) {
+        for (c = 0; c < 4; c++)
+            C[(i + r) * n + j + c] = acc[r][c];
+    }
+#endif
+}
+
+/* 4x4 blocks over k tiles; rows and columns past the last full block go scalar */
+static void mm_neon(const double *A, const double *B, double *C, int n)
+{
+    int n4 = n & ~3;
+    int kk, k1, i, j, k;
+
+    memset(C, 0, (size_t)n * n * sizeof(double));
+    for (kk = 0; kk < n; kk += tile) {
+        k1 = min_int(kk + tile, n);
+        for (i = 0; i < n4; i += 4) {
+            for (j = 0; j < n4; j += 4)
+                mm_block4x4(A, B, C, n, i, j, kk, k1);
+        }
+        for (i = 0; i < n; i++) {
+            for (k = kk; k < k1; k++) {
+                double a = A[i * n + k];
+                for (j = i < n4 ? n4 : 0; j < n; j++)
+                    C[i * n + j] += a * B[k * n + j];
+            }
+        }
+    }
+}
+
+static const struct kernel kernels[] = {
+    { "naive",      mm_naive },
+    { "ikj",        mm_ikj },
+    { "transposed", mm_transposed },
+    { "tiled",      mm_tiled },
+    { "neon",       mm_neon },
+};
+
+#define NR_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static int find_kernel(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NR_KERNELS; i++) {
+        if (!strcmp(kernels[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/* B is the identity, so every kernel must reproduce A */
+static int check_result(const char *name, const double *A, const double *C, int n)
+{
+    int i;
+
+    for (i = 0; i < n * n; i++) {
+        if (C[i] != A[i]) {
+            fprintf(stderr, "%s: result differs from the reference at n=%d\n",
+                    name, n);
+            return -1;
+        }
+    }
+    return 0;
+}
 
-    size_t bytes = (size_t)N * N * sizeof(double);
-    A = malloc(bytes);
-    B = malloc(bytes);
-    C = malloc(bytes);
+static void init_matrices(double *A, double *B, double *C, int n)
+{
+    int i, j;
 
-    if (!A || !B || !C) {
-        perror("malloc");
-        free(A); free(B); free(C);
-        return 1;
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < n; j++) {
+            A[i * n + j] = (double)(i + j);
+            B[i * n + j] = (double)(i == j ? 1.0 : 0.0);
+            C[i * n + j] = 0.0;
+        }
     }
+}
 
-    printf("Matrix size: %dx%d, each %.2f MB (total ~%.2f MB)\n",
-           N, N,
+static int run_phases(struct pmu *pmu, const int *selected, int nr_selected,
+                      double *A, double *B, double *C, int n)
+{
+    struct pmu_snapshot init_snap, mm_snap;
+    long long checksum = 0;
+    size_t bytes = (size_t)n * n * sizeof(double);
+    char label[96];
+    double start, seconds;
+    int i, phase = 2;
+
+    printf("Matrix size: %dx%d, each %.2f MB (total ~%.2f MB), tile %d\n",
+           n, n,
            (double)bytes / (1024.0 * 1024.0),
-           3.0 * (double)bytes / (1024.0 * 1024.0));
+           3.0 * (double)bytes / (1024.0 * 1024.0), tile);
+
 
-    
     printf("[Phase 1] Initializing matrices A and B...\n");
 
-    if (pmu_control("start\n") < 0) goto out;
+    if (pmu_start(pmu) < 0) goto pmu_fail;
+    init_matrices(A, B, C, n);
+    if (pmu_stop(pmu, &init_snap) < 0) goto pmu_fail;
+
+    print_stats("Phase 1 (matrix initialization)", &init_snap);
+
+    for (i = 0; i < nr_selected; i++, phase++) {
+        const struct kernel *kern = &kernels[selected[i]];
+
+        printf("[Phase %d] Performing matrix multiplication C = A * B (%s)...\n",
+               phase, kern->name);
+
+        if (pmu_start(pmu) < 0) goto pmu_fail;
+        start = now_sec();
+        kern->fn(A, B, C, n);
+        seconds = now_sec() - start;
+        if (pmu_stop(pmu, &mm_snap) < 0) goto pmu_fail;
+
+        /* naive keeps the label part4.py always plotted */
+        if (!strcmp(kern->name, "naive"))
+            snprintf(label, sizeof(label), "Phase %d (matrix multiplication)", phase);
+        else
+            snprintf(label, sizeof(label), "Phase %d (matrix multiplication, %s)",
+                     phase, kern->name);
+        print_stats(label, &mm_snap);
+        print_rates(&mm_snap, 2.0 * n * n * n, seconds);
+
+        if (check_result(kern->name, A, C, n) < 0)
+            return -1;
+    }
+
+
+    for (i = 0; i < n; i++)
+        checksum += (long long)C[i * n + (i % n)];
+    printf("Checksum: %lld\n", checksum);
+    return 0;
+
+pmu_fail:
+    perror("pmu");
+    return -1;
+}
+
+/* sizes from min to max, steps per doubling, rounded and without repeats */
+static int sweep_sizes(int *sizes, int max_sizes, int min, int max, int steps)
+{
+    int nr = 0, k, n;
+
+    for (k = 0; nr < max_sizes; k++) {
+        n = (int)(min * pow(2.0, (double)k / steps) + 0.5);
+        if (n > max)
+            break;
+        if (!nr || n != sizes[nr - 1])
+            sizes[nr++] = n;
+    }
+    return nr;
+}
+
+static void csv_header(FILE *out, const struct pmu_event_config *config)
+{
+    const char *name;
+    unsigned int i;
+
+    fprintf(out, "n,kernel,tile,rep,iters,seconds,gflops,cycles");
+    for (i = 0; i < config->nr_events; i++) {
+        name = pmu_event_name(config->event[i]);
+        if (name)
+            fprintf(out, ",%s", name);
+        else
+            fprintf(out, ",event_0x%02x", config->event[i]);
+    }
+    fprintf(out, ",ipc,l1d_miss_rate,llc_miss_rate\n");
+}
+
+/* counts are per multiplication, averaged over iters back-to-back calls */
+static void csv_row(FILE *out, int n, const char *kernel, int rep, int iters,
+                    double seconds, const struct pmu_snapshot *snap)
+{
+    const struct pmu_counts *t = &snap->total;
+    double instr = pmu_count(snap, t, EVT_INSTR_RETIRED);
+    double l1d = pmu_count(snap, t, EVT_L1D_ACCESS);
+    unsigned int i;
+
+    fprintf(out, "%d,%s,%d,%d,%d,%.6f,%.4f,%.0f", n, kernel, tile, rep, iters,
+            seconds / iters, 2.0 * n * n * n * iters / seconds / 1e9,
+            (double)t->cycles / iters);
+    for (i = 0; i < snap->config.nr_events; i++) {
+        if (pmu_counted(t, i))
+            fprintf(out, ",%.0f", (double)t->event[i] / iters);
+        else
+            fprintf(out, ",");
+    }
+    fprintf(out, ",%.4f,%.6f,%.6f\n",
+            t->cycles ? instr / t->cycles : 0.0,
+            l1d ? pmu_count(snap, t, EVT_L1D_REFILL) / l1d : 0.0,
+            l1d ? pmu_count(snap, t, EVT_LLC_REFILL) / l1d : 0.0);
+}
+
+/*
+ * Every size x kernel: warmup unmeasured calls (at least one), the last of
+ * which also checks the result and sets iters so that one measured repeat
+ * lasts at least MIN_REP_SEC, then repeat measured repeats of iters calls.
+ */
+#define MIN_REP_SEC 0.05
+
+static int run_sweep(struct pmu *pmu, const int *selected, int nr_selected,
+                     double *A, double *B, double *C, const int *sizes,
+                     int nr_sizes, int warmup, int repeat, FILE *out)
+{
+    struct pmu_snapshot snap;
+    double start, seconds;
+    int s, i, w, r, it, iters, n;
+
+    for (s = 0; s < nr_sizes; s++) {
+        n = sizes[s];
+        init_matrices(A, B, C, n);
 
-    for (i = 0; i < N; i++) {
-        for (j = 0; j < N; j++) {
-            A[i * N + j] = (double)(i + j);
-            B[i * N + j] = (double)(i == j ? 1.0 : 0.0);  
-            C[i * N + j] = 0.0;
+        for (i = 0; i < nr_selected; i++) {
+            const struct kernel *kern = &kernels[selected[i]];
+
+            fprintf(stderr, "n=%d %s\n", n, kern->name);
+            seconds = 0;
+            for (w = 0; w < warmup || w == 0; w++) {
+                start = now_sec();
+                kern->fn(A, B, C, n);
+                seconds = now_sec() - start;
+            }
+            if (check_result(kern->name, A, C, n) < 0)
+                return -1;
+            iters = seconds < MIN_REP_SEC ? (int)(MIN_REP_SEC / (seconds + 1e-9)) + 1 : 1;
+
+            for (r = 0; r < repeat; r++) {
+                if (pmu_start(pmu) < 0)
+                    goto pmu_fail;
+                start = now_sec();
+                for (it = 0; it < iters; it++)
+                    kern->fn(A, B, C, n);
+                seconds = now_sec() - start;
+                if (pmu_stop(pmu, &snap) < 0)
+                    goto pmu_fail;
+
+                if (!s && !i && !r)
+                    csv_header(out, &snap.config);
+                csv_row(out, n, kern->name, r, iters, seconds, &snap);
+            }
+            fflush(out);
         }
     }
+    return 0;
+
+pmu_fail:
+    perror("pmu");
+    return -1;
+}
 
-    if (pmu_control("stop\n") < 0) goto out;
-    if (pmu_read_stats(&init_stats) < 0) goto out;
+/*
+ * Scaling mode: the tiled multiply split over 1..max pinned threads,
+ * either by bands of rows or by C tiles handed out from a shared counter.
+ * The counters run system wide, so snap.cpu[] attributes every delta to
+ * the core that did the work (module backend only, perf has no per-cpu
+ * split).
+ */
+enum mt_split {
+    SPLIT_ROWS,
+    SPLIT_TILES,
+};
 
-    print_stats("Phase 1 (matrix initialization)", &init_stats);
+static const char *const split_names[] = { "rows", "tiles" };
 
-    
-    printf("[Phase 2] Performing matrix multiplication C = A * B...\n");
+struct mt_thread {
+    pthread_t tid;
+    int id;
+    int cpu;
+};
 
-    if (pmu_control("start\n") < 0) goto out;
+static struct {
+    const double *A, *B;
+    double *C;
+    int n;
+    int nr_threads;
+    enum mt_split split;
+    int next_tile;
+    int go;             /* set once the counters run */
+} mt;
 
-    for (i = 0; i < N; i++) {
-        for (j = 0; j < N; j++) {
-            double sum = 0.0;
-            for (k = 0; k < N; k++) {
-                sum += A[i * N + k] * B[k * N + j];
+struct mt_result {
+    int threads;
+    enum mt_split split;
+    double seconds;
+    double llc_misses;
+    double ipc[PMU_MAX_CPUS];
+};
+
+/* C[i0..i1)[j0..j1) = A[i0..i1) * B[..][j0..j1), i-k-j over k tiles */
+static void mm_block(const double *A, const double *B, double *C, int n,
+                     int i0, int i1, int j0, int j1)
+{
+    int kk, i, j, k;
+
+    for (i = i0; i < i1; i++)
+        memset(&C[i * n + j0], 0, (j1 - j0) * sizeof(double));
+
+    for (kk = 0; kk < n; kk += tile) {
+        for (i = i0; i < i1; i++) {
+            for (k = kk; k < min_int(kk + tile, n); k++) {
+                double a = A[i * n + k];
+                for (j = j0; j < j1; j++)
+                    C[i * n + j] += a * B[k * n + j];
             }
-            C[i * N + j] = sum;
         }
     }
+}
 
-    if (pmu_control("stop\n") < 0) goto out;
-    if (pmu_read_stats(&mm_stats) < 0) goto out;
+static void *mt_worker(void *arg)
+{
+    struct mt_thread *t = arg;
+    int n = mt.n, per_row = (n + tile - 1) / tile;
+    int job, bi, bj;
+    cpu_set_t set;
 
-    print_stats("Phase 2 (matrix multiplication)", &mm_stats);
+    CPU_ZERO(&set);
+    CPU_SET(t->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        fprintf(stderr, "thread %d: cannot pin to cpu %d\n", t->id, t->cpu);
 
-    
-    for (i = 0; i < N; i++)
-        checksum += (long long)C[i * N + (i % N)];
-    printf("Checksum: %lld\n", checksum);
+    while (!__atomic_load_n(&mt.go, __ATOMIC_ACQUIRE))
+        sched_yield();
 
-out:
-    free(A); free(B); free(C);
+    if (mt.split == SPLIT_ROWS) {
+        mm_block(mt.A, mt.B, mt.C, n, t->id * n / mt.nr_threads,
+                 (t->id + 1) * n / mt.nr_threads, 0, n);
+        return NULL;
+    }
+
+    while ((job = __atomic_fetch_add(&mt.next_tile, 1, __ATOMIC_RELAXED)) <
+           per_row * per_row) {
+        bi = job / per_row * tile;
+        bj = job % per_row * tile;
+        mm_block(mt.A, mt.B, mt.C, n, bi, min_int(bi + tile, n),
+                 bj, min_int(bj + tile, n));
+    }
+    return NULL;
+}
+
+/* one multiply on nr_threads pinned threads; snap may be NULL for a warm-up */
+static int mt_run(struct pmu *pmu, int nr_threads, struct mt_thread *threads,
+                  struct pmu_snapshot *snap, double *seconds)
+{
+    double start;
+    int i, created, ret = 0;
+
+    mt.nr_threads = nr_threads;
+    mt.next_tile = 0;
+    mt.go = 0;
+
+    for (created = 0; created < nr_threads; created++) {
+        if (pthread_create(&threads[created].tid, NULL, mt_worker,
+                           &threads[created]))
+            break;
+    }
+    if (created < nr_threads) {
+        fprintf(stderr, "pthread_create failed\n");
+        ret = -1;
+    }
+
+    if (snap && !ret && pmu_start(pmu) < 0)
+        ret = -1;
+    start = now_sec();
+    __atomic_store_n(&mt.go, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < created; i++)
+        pthread_join(threads[i].tid, NULL);
+    *seconds = now_sec() - start;
+    if (snap && !ret && pmu_stop(pmu, snap) < 0)
+        ret = -1;
+    return ret;
+}
+
+static void print_per_core(const struct pmu_snapshot *snap,
+                           const struct mt_thread *threads, int nr_threads,
+                           struct mt_result *res)
+{
+    const struct pmu_counts *c;
+    double instr;
+    int i, cpu;
+
+    if (!snap->nr_cpus) {
+        printf("(no per-cpu counts with the perf backend)\n");
+        return;
+    }
+
+    printf("%4s %5s %14s %14s %6s %12s %12s\n",
+           "thr", "cpu", "cycles", "instructions", "ipc", "l1d_misses", "llc_misses");
+    for (i = 0; i < nr_threads; i++) {
+        cpu = threads[i].cpu;
+        if (cpu >= PMU_MAX_CPUS || cpu >= (int)snap->nr_cpus)
+            continue;
+        c = &snap->cpu[cpu];
+        instr = pmu_count(snap, c, EVT_INSTR_RETIRED);
+        res->ipc[i] = c->cycles ? instr / c->cycles : 0.0;
+        printf("%4d %5d %14llu %14.0f %6.2f %12llu %12llu\n", i, cpu,
+               c->cycles, instr, res->ipc[i],
+               pmu_count(snap, c, EVT_L1D_REFILL),
+               pmu_count(snap, c, EVT_LLC_REFILL));
+    }
+}
+
+static int run_scaling(struct pmu *pmu, double *A, double *B, double *C,
+                       int n, int max_threads)
+{
+    struct mt_thread threads[PMU_MAX_CPUS];
+    struct mt_result results[2 * PMU_MAX_CPUS], *res, *base = NULL;
+    struct pmu_snapshot snap;
+    double seconds;
+    int nr_results = 0, ncpus, split, t, i;
+
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+    for (i = 0; i < max_threads; i++) {
+        threads[i].id = i;
+        threads[i].cpu = i % ncpus;
+    }
+
+    init_matrices(A, B, C, n);
+    mt.A = A;
+    mt.B = B;
+    mt.C = C;
+    mt.n = n;
+
+    printf("Matrix size: %dx%d, tile %d, 1..%d threads pinned to cpus 0..%d (%s backend)\n",
+           n, n, tile, max_threads, min_int(max_threads, ncpus) - 1,
+           pmu_backend_name(pmu));
+
+    for (split = SPLIT_ROWS; split <= SPLIT_TILES; split++) {
+        mt.split = split;
+        for (t = 1; t <= max_threads; t++) {
+            res = &results[nr_results++];
+            memset(res, 0, sizeof(*res));
+            res->threads = t;
+            res->split = split;
+
+            if (mt_run(pmu, t, threads, NULL, &seconds) < 0 ||
+                mt_run(pmu, t, threads, &snap, &seconds) < 0) {
+                perror("pmu");
+                return -1;
+            }
+            if (check_result(split_names[split], A, C, n) < 0)
+                return -1;
+
+            res->seconds = seconds;
+            res->llc_misses = pmu_count(&snap, &snap.total, EVT_LLC_REFILL);
+            printf("\n==== %s, %d threads: %.3f s, %.3f GFLOP/s ====\n",
+                   split_names[split], t, seconds, 2.0 * n * n * n / seconds / 1e9);
+            print_per_core(&snap, threads, t, res);
+        }
+    }
+
+    printf("\n%-6s %7s %9s %8s %8s %12s  %s\n", "split", "threads", "seconds",
+           "speedup", "gflops", "llc_misses", "ipc per core");
+    for (i = 0; i < nr_results; i++) {
+        res = &results[i];
+        if (res->threads == 1)
+            base = res;
+        printf("%-6s %7d %9.3f %8.2f %8.3f %12.0f ", split_names[res->split],
+               res->threads, res->seconds, base->seconds / res->seconds,
+               2.0 * n * n * n / res->seconds / 1e9, res->llc_misses);
+        for (t = 0; t < res->threads; t++)
+            printf(" %.2f", res->ipc[t]);
+        printf("\n");
+    }
     return 0;
 }
+
+/*
+ * Fast-read mode: the same short multiply measured by two readers, in
+ * alternating repeats on one pinned cpu. pmu_fast_read() reads the
+ * counters with mrs at EL0 (pmu_fast.h), the other reader is the local
+ * snapshot ioctl. Both see the cpu's raw counters, so the difference of
+ * their medians is what an ioctl pair adds to every region it brackets.
+ * The cost of a single read of each kind is timed first.
+ */
+#define FAST_READS 10000
+
+static int cmp_u64(const void *a, const void *b)
+{
+    __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static __u64 median_u64(__u64 *v, int nr)
+{
+    if (!nr)
+        return 0;
+    qsort(v, nr, sizeof(v[0]), cmp_u64);
+    return v[nr / 2];
+}
+
+/* ns and cycles per read, cycles from the fast counters around the loop */
+static int fast_read_cost(struct pmu *pmu, int fast, unsigned int nr,
+                          double *ns, double *cycles)
+{
+    struct pmu_local_snapshot local;
+    struct pmu_fast_sample a, b, s, d;
+    double start;
+    int i;
+
+    pmu_fast_read(&a, 0);
+    start = now_sec();
+    for (i = 0; i < FAST_READS; i++) {
+        if (fast ? pmu_fast_read(&s, nr) : pmu_snapshot_local(pmu, &local))
+            return -1;
+    }
+    *ns = (now_sec() - start) * 1e9 / FAST_READS;
+    pmu_fast_read(&b, 0);
+    *cycles = pmu_fast_delta(&a, &b, 0, &d) ? 0.0 : (double)d.cycles / FAST_READS;
+    return 0;
+}
+
+static int run_fast(struct pmu *pmu, const int *selected, int nr_selected,
+                    double *A, double *B, double *C, int n, int reps)
+{
+    struct pmu_local_snapshot la, lb;
+    struct pmu_fast_sample a, b, d;
+    struct pmu_snapshot snap;
+    __u64 *fast_cyc, *fast_ins, *ioctl_cyc, *ioctl_ins;
+    double ns[2], cyc[2];
+    unsigned int nr;
+    int i, r, nf, ni, instr = -1, started = 0, ret = -1;
+    cpu_set_t set;
+
+    if (!pmu_fast_enabled()) {
+        fprintf(stderr, "-F needs AArch64 and the module's user access "
+                "(echo \"useraccess on\" | sudo tee /proc/pmu_control)\n");
+        return -1;
+    }
+    if (pmu_snapshot(pmu, &snap) < 0) {
+        perror("pmu_snapshot");
+        return -1;
+    }
+    /* counter i holds event i only while nothing is multiplexed */
+    nr = snap.config.nr_events;
+    if (nr > PMU_FAST_MAX_COUNTERS) {
+        fprintf(stderr, "-F: %u events are multiplexed, configure at most %d\n",
+                nr, PMU_FAST_MAX_COUNTERS);
+        return -1;
+    }
+    for (i = 0; i < (int)nr; i++) {
+        if (snap.config.event[i] == EVT_INSTR_RETIRED)
+            instr = i;
+    }
+
+    fast_cyc = calloc(4 * (size_t)reps, sizeof(__u64));
+    if (!fast_cyc) {
+        perror("calloc");
+        return -1;
+    }
+    fast_ins = fast_cyc + reps;
+    ioctl_cyc = fast_ins + reps;
+    ioctl_ins = ioctl_cyc + reps;
+
+    if (!snap.state) {
+        if (pmu_start(pmu) < 0)
+            goto pmu_fail;
+        started = 1;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(sched_getcpu(), &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("sched_setaffinity");
+
+    if (fast_read_cost(pmu, 1, nr, &ns[0], &cyc[0]) < 0 ||
+        fast_read_cost(pmu, 0, nr, &ns[1], &cyc[1]) < 0)
+        goto pmu_fail;
+    printf("Read cost on cpu %d (%s backend), %u event counters:\n",
+           sched_getcpu(), pmu_backend_name(pmu), nr);
+    printf("  mrs   : %8.1f ns %8.0f cycles per read\n", ns[0], cyc[0]);
+    printf("  ioctl : %8.1f ns %8.0f cycles per read\n\n", ns[1], cyc[1]);
+
+    init_matrices(A, B, C, n);
+    printf("%-10s %5s %6s %12s %12s %12s %12s %12s\n", "kernel", "n", "reps",
+           "mrs_cycles", "ioctl_cycles", "overhead", "mrs_instr", "ioctl_instr");
+    for (i = 0; i < nr_selected; i++) {
+        const struct kernel *kern = &kernels[selected[i]];
+
+        kern->fn(A, B, C, n);   /* warm-up */
+        nf = ni = 0;
+        for (r = 0; r < reps; r++) {
+            if (pmu_fast_read(&a, nr) == 0) {
+                kern->fn(A, B, C, n);
+                if (pmu_fast_read(&b, nr) == 0 &&
+                    pmu_fast_delta(&a, &b, nr, &d) == 0) {
+                    fast_cyc[nf] = d.cycles;
+                    fast_ins[nf++] = instr >= 0 ? d.event[instr] : 0;
+                }
+            }
+
+            if (pmu_snapshot_local(pmu, &la) < 0)
+                goto pmu_fail;
+            kern->fn(A, B, C, n);
+            if (pmu_snapshot_local(pmu, &lb) < 0)
+                goto pmu_fail;
+            /* both on one cpu and nobody else ran on it in between */
+            if (la.cpu == lb.cpu && la.switches == lb.switches) {
+                ioctl_cyc[ni] = lb.counts.cycles - la.counts.cycles;
+                ioctl_ins[ni++] = instr >= 0 ?
+                    lb.counts.event[instr] - la.counts.event[instr] : 0;
+            }
+        }
+
+        fast_cyc[0] = median_u64(fast_cyc, nf);
+        fast_ins[0] = median_u64(fast_ins, nf);
+        ioctl_cyc[0] = median_u64(ioctl_cyc, ni);
+        ioctl_ins[0] = median_u64(ioctl_ins, ni);
+        printf("%-10s %5d %6d %12llu %12llu %12lld %12llu %12llu\n",
+               kern->name, n, reps, fast_cyc[0], ioctl_cyc[0],
+               (long long)(ioctl_cyc[0] - fast_cyc[0]), fast_ins[0], ioctl_ins[0]);
+        if (nf < reps || ni < reps)
+            printf("  (%d mrs and %d ioctl repeats dropped, migrated or preempted)\n",
+                   reps - nf, reps - ni);
+    }
+    ret = 0;
+    goto out;
+
+pmu_fail:
+    perror("pmu");
+out:
+    if (started)
+        pmu_stop(pmu, NULL);
+    free(fast_cyc);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    int i;
+
+    fprintf(stderr,
+            "usage: %s [-k kernel,...] [-t tile] [-n size] [-a policy]\n"
+            "       %s -s min:max[:steps] [-k kernel,...] [-t tile] [-w warmup] [-r repeat] [-o file]\n"
+            "       %s -T threads [-t tile] [-n size]\n"
+            "       %s -F reps [-k kernel,...] [-t tile] [-n size]\n"
+            "  -s  sweep sizes from min to max, steps sizes per doubling (default 1), CSV out\n"
+            "  -T  tiled multiply on 1..threads pinned threads, per-core counts and scaling\n"
+            "  -F  reps multiplies each read with mrs (pmu_fast.h) and with the ioctl\n"
+            "  -a  matrix allocation, %s (default malloc)\n"
+            "kernels:", prog, prog, prog, prog, bench_alloc_names());
+    for (i = 0; i < NR_KERNELS; i++)
+        fprintf(stderr, " %s", kernels[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    double *A = NULL, *B = NULL, *C = NULL;
+    struct pmu *pmu = NULL;
+    FILE *out = stdout;
+    int selected[NR_KERNELS], sizes[MAX_SIZES];
+    int nr_selected = 0, nr_sizes = 0;
+    int n = DEFAULT_N, sweep_min = 0, sweep_max = 0, sweep_steps = 1;
+    int warmup = 1, repeat = 3, max_threads = 0, fast_reps = 0, max_n;
+    int policy = BENCH_ALLOC_MALLOC, tlb = 0, reprogrammed = 0;
+    struct pmu_event_config saved;
+    size_t bytes = 0;
+    char *list = NULL, *path = NULL, *tok;
+    int i, opt, ret = 1;
+
+    while ((opt = getopt(argc, argv, "k:t:n:s:w:r:o:T:F:a:")) != -1) {
+        switch (opt) {
+        case 'k': list = optarg; break;
+        case 't': tile = atoi(optarg); break;
+        case 'n': n = atoi(optarg); break;
+        case 's':
+            if (sscanf(optarg, "%d:%d:%d", &sweep_min, &sweep_max, &sweep_steps) < 2)
+                usage(argv[0]);
+            break;
+        case 'w': warmup = atoi(optarg); break;
+        case 'r': repeat = atoi(optarg); break;
+        case 'o': path = optarg; break;
+        case 'T': max_threads = atoi(optarg); break;
+        case 'F': fast_reps = atoi(optarg); break;
+        case 'a':
+            policy = bench_alloc_parse(optarg);
+            if (policy < 0)
+                usage(argv[0]);
+            tlb = 1;
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (tile < 4 || n < 1 || repeat < 1 || warmup < 0 ||
+        max_threads < 0 || max_threads > PMU_MAX_CPUS || fast_reps < 0)
+        usage(argv[0]);
+
+    if (list) {
+        for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+            i = find_kernel(tok);
+            if (i < 0 || nr_selected == NR_KERNELS)
+                usage(argv[0]);
+            selected[nr_selected++] = i;
+        }
+    } else {
+        for (i = 0; i < NR_KERNELS; i++)
+            selected[nr_selected++] = i;
+    }
+
+    if (sweep_min) {
+        if (sweep_min < 1 || sweep_max < sweep_min || sweep_steps < 1)
+            usage(argv[0]);
+        nr_sizes = sweep_sizes(sizes, MAX_SIZES, sweep_min, sweep_max, sweep_steps);
+        max_n = sizes[nr_sizes - 1];
+    } else {
+        max_n = n;
+    }
+
+    /* once, at the largest size; smaller sizes use the front of each buffer */
+    bytes = (size_t)max_n * max_n * sizeof(double);
+    A = bench_alloc(bytes, policy);
+    B = bench_alloc(bytes, policy);
+    C = bench_alloc(bytes, policy);
+    Bt = bench_alloc(bytes, policy);
+
+    if (!A || !B || !C || !Bt) {
+        perror(bench_alloc_name(policy));
+        goto out;
+    }
+
+    pmu = pmu_open();
+    if (!pmu) {
+        perror("pmu_open");
+        goto out;
+    }
+
+    if (tlb) {
+        if (bench_tlb_events(pmu, &saved) < 0) {
+            perror("pmu_set_events");
+            goto out;
+        }
+        reprogrammed = 1;
+    }
+
+    if (max_threads) {
+        ret = run_scaling(pmu, A, B, C, n, max_threads) ? 1 : 0;
+        goto out;
+    }
+    if (fast_reps) {
+        ret = run_fast(pmu, selected, nr_selected, A, B, C, n, fast_reps) ? 1 : 0;
+        goto out;
+    }
+    if (!sweep_min) {
+        ret = run_phases(pmu, selected, nr_selected, A, B, C, n) ? 1 : 0;
+        goto out;
+    }
+
+    if (path) {
+        out = fopen(path, "w");
+        if (!out) {
+            perror(path);
+            goto out;
+        }
+    }
+    ret = run_sweep(pmu, selected, nr_selected, A, B, C, sizes, nr_sizes,
+                    warmup, repeat, out) ? 1 : 0;
+    if (out != stdout)
+        fclose(out);
+
+out:
+    if (reprogrammed && bench_restore_events(pmu, &saved) < 0)
+        perror("pmu_set_events");
+    pmu_close(pmu);
+    bench_free(A, bytes, policy);
+    bench_free(B, bytes, policy);
+    bench_free(C, bytes, policy);
+    bench_free(Bt, bytes, policy);
+    return ret;
+}
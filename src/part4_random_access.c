@@ -1,150 +1,816 @@
-
-
-
-
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <time.h>
 
-#define PMU_CTRL_PATH  "/proc/pmu_control"
-#define PMU_STATS_PATH "/proc/pmu_stats"
+#include "bench_alloc.h"
+#include "libpmu.h"
+
+/*
+ * Sequential scan, then one random-access phase per index generator:
+ *
+ *   random_access_phases [-g rand,xorshift,xorshift_mask,pcg,pcg_mask,perm]
+ *
+ * rand is the original rand() % size. xorshift and pcg are inlined
+ * generators reduced with a modulo by the run-time size (a real division),
+ * the _mask variants with & (size - 1),
+ * and perm reads a shuffled index buffer filled before the phase. Each
+ * generator also runs once without touching arr; that run's counts are the
+ * generator's share of the phase, the rest is the memory access.
+ *
+ *   random_access_phases -c 4K:1G [-H]
+ *
+ * replaces the phases with a dependent pointer-chase latency sweep, see
+ * run_chase(), and
+ *
+ *   random_access_phases -m 256M [-H]
+ *
+ * with the memory-level-parallelism and prefetch sweep of run_mlp(), and
+ *
+ *   random_access_phases -p 256M [-H]
+ *
+ * with the stride and access-pattern sweep of run_patterns().
+ *
+ * -a picks how arr and the sweep buffers are allocated (see bench_alloc.h,
+ * -H is -a thp). Any -a, malloc included, swaps the L1I events for the L1D
+ * and L2D TLB refills so every policy counts the same six; the old events
+ * are put back at exit.
+ */
 
-#define ARRAY_SIZE (16 * 4 * 1024 * 1024)  
+#define ARRAY_SIZE (16 * 4 * 1024 * 1024)   /* a power of two, for the masks */
 #define RANDOM_ITERS (4 * ARRAY_SIZE)
 
-struct pmu_stats {
-    unsigned long long instructions;
-    unsigned long long l1i_ref;
-    unsigned long long l1i_miss;
-    unsigned long long l1d_ref;
-    unsigned long long l1d_miss;
-    unsigned long long llc_miss;
-    unsigned long long cycles;
+static void print_stats(const char *label, const struct pmu_snapshot *snap)
+{
+    const char *name;
+    unsigned int i;
+
+    printf("==== PMU statistics for %s ====\n", label);
+    for (i = 0; i < snap->config.nr_events; i++) {
+        name = pmu_event_name(snap->config.event[i]);
+        if (name)
+            printf("%-12s : ", name);
+        else
+            printf("event_0x%02x   : ", snap->config.event[i]);
+        if (pmu_counted(&snap->total, i))
+            printf("%llu\n", snap->total.event[i]);
+        else
+            printf("n/a\n");
+    }
+    printf("cycles       : %llu\n\n", snap->total.cycles);
+}
+
+static __u64 xorshift64(__u64 *s)
+{
+    __u64 x = *s;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *s = x;
+    return x;
+}
+
+/* PCG32 XSH-RR */
+static __u32 pcg32(__u64 *s)
+{
+    __u64 old = *s;
+    __u32 xorshifted, rot;
+
+    *s = old * 6364136223846793005ULL + 1442695040888963407ULL;
+    xorshifted = (__u32)(((old >> 18) ^ old) >> 27);
+    rot = (__u32)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+static __u32 *perm;
+
+/*
+ * One loop per generator and mode so the access loop has no branch in it.
+ * touch = 0 sums the indices instead of loading arr[idx]: same generator
+ * work, no memory access. n is the array size, passed at run time so the
+ * modulo stays a division: with the constant power of two the compiler
+ * turns % into the same & as the _mask variants. rand is the phase from
+ * before the generators existed, kept bit-identical so old results still
+ * compare: seeded with the time, reduced by the constant ARRAY_SIZE.
+ */
+#define DEFINE_ACCESS(name, state, next)                                    \
+static long long access_##name(const int *arr, size_t n, size_t iters,     \
+                               int touch)                                   \
+{                                                                           \
+    long long sum = 0;                                                      \
+    size_t i, idx;                                                          \
+    state;                                                                  \
+                                                                            \
+    if (touch) {                                                            \
+        for (i = 0; i < iters; i++) {                                       \
+            idx = (next);                                                   \
+            sum += arr[idx];                                                \
+        }                                                                   \
+    } else {                                                                \
+        for (i = 0; i < iters; i++) {                                       \
+            idx = (next);                                                   \
+            sum += idx;                                                     \
+        }                                                                   \
+    }                                                                       \
+    return sum;                                                             \
+}
+
+DEFINE_ACCESS(rand, srand((unsigned)time(NULL)); (void)n,
+              (size_t)(rand() % ARRAY_SIZE))
+DEFINE_ACCESS(xorshift, __u64 s = 88172645463325252ULL,
+              (size_t)(xorshift64(&s) % n))
+DEFINE_ACCESS(xorshift_mask, __u64 s = 88172645463325252ULL,
+              (size_t)(xorshift64(&s) & (n - 1)))
+DEFINE_ACCESS(pcg, __u64 s = 0x853c49e6748fea9bULL,
+              (size_t)(pcg32(&s) % n))
+DEFINE_ACCESS(pcg_mask, __u64 s = 0x853c49e6748fea9bULL,
+              (size_t)(pcg32(&s) & (n - 1)))
+DEFINE_ACCESS(perm, (void)0, (size_t)perm[i & (n - 1)])
+
+struct generator {
+    const char *name;
+    long long (*fn)(const int *arr, size_t n, size_t iters, int touch);
+};
+
+static const struct generator generators[] = {
+    { "rand",          access_rand },
+    { "xorshift",      access_xorshift },
+    { "xorshift_mask", access_xorshift_mask },
+    { "pcg",           access_pcg },
+    { "pcg_mask",      access_pcg_mask },
+    { "perm",          access_perm },
 };
 
-static int pmu_control(const char *cmd)
+#define NR_GENERATORS (int)(sizeof(generators) / sizeof(generators[0]))
+
+/* Fisher-Yates over 0..n-1, outside any measured phase */
+static __u32 *make_perm(size_t n)
 {
-    int fd = open(PMU_CTRL_PATH, O_WRONLY);
-    if (fd < 0) {
-        perror("open pmu_control");
-        return -1;
+    __u64 s = 0x9e3779b97f4a7c15ULL;
+    __u32 *p, tmp;
+    size_t i, j;
+
+    p = malloc(sizeof(*p) * n);
+    if (!p)
+        return NULL;
+    for (i = 0; i < n; i++)
+        p[i] = (__u32)i;
+    for (i = n - 1; i > 0; i--) {
+        j = xorshift64(&s) % (i + 1);
+        tmp = p[i];
+        p[i] = p[j];
+        p[j] = tmp;
+    }
+    return p;
+}
+
+static double share(double part, double whole)
+{
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void print_split(const struct pmu_snapshot *full,
+                        const struct pmu_snapshot *gen)
+{
+    double instr = pmu_count(full, &full->total, EVT_INSTR_RETIRED);
+    double gen_instr = pmu_count(gen, &gen->total, EVT_INSTR_RETIRED);
+    double cycles = full->total.cycles, gen_cycles = gen->total.cycles;
+
+    printf("  -> generator: %.1f%% of instructions, %.1f%% of cycles; "
+           "memory access: %.2f cycles per access\n\n",
+           share(gen_instr, instr), share(gen_cycles, cycles),
+           cycles > gen_cycles ? (cycles - gen_cycles) / RANDOM_ITERS : 0.0);
+}
+
+/*
+ * Pointer chase: one node per cache line, linked in a random order into a
+ * single cycle over the working set, so every load depends on the one
+ * before and none can be overlapped. Sizes sweep from min to max,
+ * doubling; the buffer is allocated once at max.
+ */
+#define CHASE_LINE  64
+#define CHASE_LOADS (16 * 1024 * 1024)
+
+struct node {
+    struct node *next;
+    char pad[CHASE_LINE - sizeof(struct node *)];
+};
+
+static void *chase_sink;
+
+/* "4K", "16M", "1G" or plain bytes; 0 if it does not parse */
+static size_t parse_size(const char *str, char **end)
+{
+    size_t val = strtoull(str, end, 0);
+
+    switch (**end) {
+    case 'G': case 'g': val <<= 10; /* fall through */
+    case 'M': case 'm': val <<= 10; /* fall through */
+    case 'K': case 'k': val <<= 10; (*end)++; break;
     }
-    ssize_t len = strlen(cmd);
-    if (write(fd, cmd, len) != len) {
-        perror("write pmu_control");
-        close(fd);
+    return val;
+}
+
+/* a random single cycle through the first nr nodes; -1 if out of memory */
+static int chase_link(struct node *nodes, size_t nr)
+{
+    __u64 s = 0x2545f4914f6cdd1dULL;
+    __u32 *order, tmp;
+    size_t i, j;
+
+    order = malloc(sizeof(*order) * nr);
+    if (!order)
         return -1;
+    for (i = 0; i < nr; i++)
+        order[i] = (__u32)i;
+    for (i = nr - 1; i > 0; i--) {
+        j = xorshift64(&s) % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
     }
-    close(fd);
+    for (i = 0; i < nr; i++)
+        nodes[order[i]].next = &nodes[order[(i + 1) % nr]];
+    free(order);
     return 0;
 }
 
-static int pmu_read_stats(struct pmu_stats *s)
+/*
+ * The loops below only read memory nothing else sees, so the compiler may
+ * move them across the clock reads; passing their input and result through
+ * OPAQUE() pins them in place.
+ */
+#define OPAQUE(x) asm volatile("" : "+r"(x) : : "memory")
+
+static struct node *chase(struct node *p, size_t loads)
+{
+    for (; loads >= 8; loads -= 8) {
+        p = p->next; p = p->next; p = p->next; p = p->next;
+        p = p->next; p = p->next; p = p->next; p = p->next;
+    }
+    while (loads--)
+        p = p->next;
+    return p;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fixed columns first, then every configured event's raw count */
+static void csv_header(const char *columns, const struct pmu_snapshot *snap)
+{
+    const char *name;
+    unsigned int i;
+
+    printf("%s", columns);
+    for (i = 0; i < snap->config.nr_events; i++) {
+        name = pmu_event_name(snap->config.event[i]);
+        if (name)
+            printf(",%s", name);
+        else
+            printf(",event_0x%02x", snap->config.event[i]);
+    }
+    printf("\n");
+}
+
+static void csv_events(const struct pmu_snapshot *snap)
+{
+    unsigned int i;
+
+    /* an event perf could not count is an empty field */
+    for (i = 0; i < snap->config.nr_events; i++) {
+        if (pmu_counted(&snap->total, i))
+            printf(",%llu", snap->total.event[i]);
+        else
+            printf(",");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/* CSV on stdout, one row per working-set size */
+static int run_chase(struct pmu *pmu, size_t min, size_t max, int policy)
+{
+    struct pmu_snapshot snap;
+    struct node *nodes, *p;
+    size_t size, nr;
+    double start, seconds, loads = CHASE_LOADS;
+    int header = 0, ret = -1;
+
+    nodes = bench_alloc(max, policy);
+    if (!nodes) {
+        perror("alloc");
+        return -1;
+    }
+
+    for (size = min; size <= max; size *= 2) {
+        nr = size / CHASE_LINE;
+        if (nr < 2)
+            continue;
+        if (chase_link(nodes, nr) < 0) {
+            perror("malloc");
+            goto out;
+        }
+
+        /* one lap to fault in and warm what fits */
+        p = chase(&nodes[0], nr);
+
+        if (pmu_start(pmu) < 0) goto pmu_fail;
+        start = now_sec();
+        OPAQUE(p);
+        p = chase(p, CHASE_LOADS);
+        OPAQUE(p);
+        seconds = now_sec() - start;
+        if (pmu_stop(pmu, &snap) < 0) goto pmu_fail;
+        chase_sink = p;
+
+        if (!header++)
+            csv_header("size_bytes,alloc,loads,ns_per_load,cycles_per_load,"
+                       "l1d_miss_per_load,llc_miss_per_load", &snap);
+        printf("%zu,%s,%d,%.3f,%.3f,%.4f,%.4f", size, bench_alloc_name(policy),
+               CHASE_LOADS,
+               seconds * 1e9 / loads, snap.total.cycles / loads,
+               pmu_count(&snap, &snap.total, EVT_L1D_REFILL) / loads,
+               pmu_count(&snap, &snap.total, EVT_LLC_REFILL) / loads);
+        csv_events(&snap);
+    }
+    ret = 0;
+    goto out;
+
+pmu_fail:
+    perror("pmu");
+out:
+    bench_free(nodes, max, policy);
+    return ret;
+}
+
+/*
+ * Memory-level parallelism over one working set, CSV on stdout:
+ *  - chains: K = 1..MLP_MAX_CHAINS chases started at evenly spaced points
+ *    of the same cycle and advanced in lockstep, so K misses can be in
+ *    flight at once;
+ *  - prefetch: the random-index loop over a shuffled index buffer with
+ *    __builtin_prefetch of the element dist iterations ahead (0 = none).
+ * Every load brings one cache line, GB/s counts whole lines.
+ */
+#define MLP_MAX_CHAINS 16
+
+static const size_t prefetch_dists[] = { 0, 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+
+static struct node *chase_chains(struct node **p, unsigned int k, size_t steps)
+{
+    unsigned int c;
+
+    for (; steps; steps--) {
+        for (c = 0; c < k; c++)
+            p[c] = p[c]->next;
+    }
+    return p[0];
+}
+
+static long long prefetch_loop(const int *a, const __u32 *idx, size_t mask,
+                               size_t iters, size_t dist)
+{
+    long long sum = 0;
+    size_t i;
+
+    if (!dist) {
+        for (i = 0; i < iters; i++)
+            sum += a[idx[i & mask]];
+        return sum;
+    }
+    for (i = 0; i < iters; i++) {
+        __builtin_prefetch(&a[idx[(i + dist) & mask]]);
+        sum += a[idx[i & mask]];
+    }
+    return sum;
+}
+
+static void mlp_row(const char *test, size_t setting, size_t size,
+                    double loads, double seconds, const struct pmu_snapshot *snap,
+                    int *header)
+{
+    if (!(*header)++)
+        csv_header("test,setting,size_bytes,loads,gb_per_s,mloads_per_s,"
+                   "l1d_miss_per_load,llc_miss_per_load", snap);
+    printf("%s,%zu,%zu,%.0f,%.3f,%.2f,%.4f,%.4f", test, setting, size, loads,
+           loads * CHASE_LINE / seconds / 1e9, loads / seconds / 1e6,
+           pmu_count(snap, &snap->total, EVT_L1D_REFILL) / loads,
+           pmu_count(snap, &snap->total, EVT_LLC_REFILL) / loads);
+    csv_events(snap);
+}
+
+static int run_mlp(struct pmu *pmu, size_t size, int policy)
 {
-    char buf[512];
-    int fd = open(PMU_STATS_PATH, O_RDONLY);
-    if (fd < 0) {
-        perror("open pmu_stats");
+    struct pmu_snapshot snap;
+    struct node *nodes = NULL, *p[MLP_MAX_CHAINS], *q;
+    __u32 *idx = NULL;
+    int *a = NULL;
+    size_t nr, n, steps, i, d;
+    long long sum;
+    double start, seconds;
+    unsigned int k, c;
+    int header = 0, ret = -1;
+
+    /* a power of two, the index loop wraps with a mask */
+    while (size & (size - 1))
+        size &= size - 1;
+    nr = size / CHASE_LINE;
+    n = size / sizeof(int);
+    if (nr < MLP_MAX_CHAINS) {
+        fprintf(stderr, "working set too small\n");
         return -1;
     }
 
-    ssize_t n = read(fd, buf, sizeof(buf) - 1);
-    if (n <= 0) {
-        perror("read pmu_stats");
-        close(fd);
+    nodes = bench_alloc(size, policy);
+    if (!nodes || chase_link(nodes, nr) < 0) {
+        perror("alloc");
+        goto out;
+    }
+
+    for (k = 1; k <= MLP_MAX_CHAINS; k++) {
+        /* start points nr / k apart along the cycle */
+        p[0] = &nodes[0];
+        for (c = 1; c < k; c++)
+            p[c] = chase(p[c - 1], nr / k);
+        steps = CHASE_LOADS / k;
+
+        if (pmu_start(pmu) < 0) goto pmu_fail;
+        start = now_sec();
+        OPAQUE(p[0]);
+        q = chase_chains(p, k, steps);
+        OPAQUE(q);
+        seconds = now_sec() - start;
+        if (pmu_stop(pmu, &snap) < 0) goto pmu_fail;
+        chase_sink = q;
+
+        mlp_row("chains", k, size, (double)steps * k, seconds, &snap, &header);
+    }
+    bench_free(nodes, size, policy);
+    nodes = NULL;
+
+    a = bench_alloc(size, policy);
+    idx = make_perm(n);
+    if (!a || !idx) {
+        perror("alloc");
+        goto out;
+    }
+    for (i = 0; i < n; i++)
+        a[i] = (int)i;
+
+    for (d = 0; d < sizeof(prefetch_dists) / sizeof(prefetch_dists[0]); d++) {
+        if (pmu_start(pmu) < 0) goto pmu_fail;
+        start = now_sec();
+        OPAQUE(a);
+        sum = prefetch_loop(a, idx, n - 1, n, prefetch_dists[d]);
+        OPAQUE(sum);
+        seconds = now_sec() - start;
+        if (pmu_stop(pmu, &snap) < 0) goto pmu_fail;
+        chase_sink = (void *)(size_t)sum;
+
+        mlp_row("prefetch", prefetch_dists[d], size, (double)n, seconds, &snap,
+                &header);
+    }
+    ret = 0;
+    goto out;
+
+pmu_fail:
+    perror("pmu");
+out:
+    bench_free(nodes, size, policy);
+    bench_free(a, size, policy);
+    free(idx);
+    return ret;
+}
+
+/*
+ * Hardware prefetcher sweep over one working set of ints, CSV on stdout:
+ *  - forward / backward: stride 1, 2, 4, ..., PATTERN_MAX_STRIDE elements.
+ *    Strides wider than a line take stride / line passes, each starting one
+ *    line further, so every pattern reads every line exactly once and only
+ *    the order changes;
+ *  - tiled: the buffer as rows of PATTERN_ROW ints (one 4K page) walked in
+ *    column blocks of setting ints, row by row inside a block. 1 is a
+ *    column walk, PATTERN_ROW plain row order.
+ * gb_per_s is lines brought in, useful_gb_per_s the ints actually summed.
+ */
+#define PATTERN_MAX_STRIDE 4096
+#define PATTERN_ROW        1024
+#define LINE_INTS          (CHASE_LINE / sizeof(int))
+
+static long long stride_sum(const int *a, size_t n, size_t stride, size_t first,
+                            int backward)
+{
+    long long sum = 0;
+    size_t i;
+
+    if (!backward) {
+        for (i = first; i < n; i += stride)
+            sum += a[i];
+        return sum;
+    }
+    for (i = n - 1 - first; i < n; i -= stride)     /* wraps past 0 */
+        sum += a[i];
+    return sum;
+}
+
+static long long tiled_sum(const int *a, size_t n, size_t width)
+{
+    long long sum = 0;
+    size_t rows = n / PATTERN_ROW, jb, i, j;
+
+    for (jb = 0; jb < PATTERN_ROW; jb += width) {
+        for (i = 0; i < rows; i++) {
+            const int *row = a + i * PATTERN_ROW + jb;
+
+            for (j = 0; j < width; j++)
+                sum += row[j];
+        }
+    }
+    return sum;
+}
+
+static void pattern_row(const char *pattern, size_t setting, size_t size,
+                        double loads, double seconds,
+                        const struct pmu_snapshot *snap, int *header)
+{
+    double lines = size / CHASE_LINE;
+
+    if (!(*header)++)
+        csv_header("pattern,setting,size_bytes,loads,seconds,gb_per_s,"
+                   "useful_gb_per_s,l1d_miss_per_line,llc_miss_per_line", snap);
+    printf("%s,%zu,%zu,%.0f,%.6f,%.3f,%.3f,%.4f,%.4f", pattern, setting, size,
+           loads, seconds, size / seconds / 1e9,
+           loads * sizeof(int) / seconds / 1e9,
+           pmu_count(snap, &snap->total, EVT_L1D_REFILL) / lines,
+           pmu_count(snap, &snap->total, EVT_LLC_REFILL) / lines);
+    csv_events(snap);
+}
+
+static int run_patterns(struct pmu *pmu, size_t size, int policy)
+{
+    struct pmu_snapshot snap;
+    int *a;
+    size_t n, stride, first, step, width, i;
+    long long sum, total = 0;
+    double start, seconds, loads;
+    int backward, header = 0, ret = -1;
+
+    while (size & (size - 1))
+        size &= size - 1;
+    n = size / sizeof(int);
+    if (n < PATTERN_MAX_STRIDE || n < PATTERN_ROW) {
+        fprintf(stderr, "working set too small\n");
         return -1;
     }
-    buf[n] = '\0';
-    close(fd);
-
-    int matched = sscanf(buf,
-                         "instructions: %llu\n"
-                         "l1i_references: %llu\n"
-                         "l1i_misses: %llu\n"
-                         "l1d_references: %llu\n"
-                         "l1d_misses: %llu\n"
-                         "llc_misses: %llu\n"
-                         "cycles: %llu",
-                         &s->instructions,
-                         &s->l1i_ref,
-                         &s->l1i_miss,
-                         &s->l1d_ref,
-                         &s->l1d_miss,
-                         &s->llc_miss,
-                         &s->cycles);
-
-    if (matched != 7) {
-        fprintf(stderr, "Failed to parse pmu_stats (matched=%d)\n", matched);
+
+    a = bench_alloc(size, policy);
+    if (!a) {
+        perror("alloc");
         return -1;
     }
-    return 0;
+    /* also faults every page in before the first pattern */
+    for (i = 0; i < n; i++)
+        a[i] = (int)i;
+
+    for (backward = 0; backward <= 1; backward++) {
+        for (stride = 1; stride <= PATTERN_MAX_STRIDE; stride *= 2) {
+            step = stride < LINE_INTS ? stride : LINE_INTS;
+            loads = 0;
+            sum = 0;
+
+            if (pmu_start(pmu) < 0) goto pmu_fail;
+            start = now_sec();
+            OPAQUE(a);
+            for (first = 0; first < stride; first += step)
+                sum += stride_sum(a, n, stride, first, backward);
+            OPAQUE(sum);
+            seconds = now_sec() - start;
+            if (pmu_stop(pmu, &snap) < 0) goto pmu_fail;
+            total += sum;
+
+            for (first = 0; first < stride; first += step)
+                loads += (n - first + stride - 1) / stride;
+            pattern_row(backward ? "backward" : "forward", stride, size,
+                        loads, seconds, &snap, &header);
+        }
+    }
+
+    for (width = 1; width <= PATTERN_ROW; width *= 2) {
+        if (pmu_start(pmu) < 0) goto pmu_fail;
+        start = now_sec();
+        OPAQUE(a);
+        sum = tiled_sum(a, n, width);
+        OPAQUE(sum);
+        seconds = now_sec() - start;
+        if (pmu_stop(pmu, &snap) < 0) goto pmu_fail;
+        total += sum;
+
+        pattern_row("tiled", width, size, (double)n, seconds, &snap, &header);
+    }
+    chase_sink = (void *)(size_t)total;
+    ret = 0;
+    goto out;
+
+pmu_fail:
+    perror("pmu");
+out:
+    bench_free(a, size, policy);
+    return ret;
 }
 
-static void print_stats(const char *label, const struct pmu_stats *s)
+static int find_generator(const char *name)
 {
-    printf("==== PMU statistics for %s ====\n", label);
-    printf("instructions : %llu\n", s->instructions);
-    printf("l1i_ref      : %llu\n", s->l1i_ref);
-    printf("l1i_miss     : %llu\n", s->l1i_miss);
-    printf("l1d_ref      : %llu\n", s->l1d_ref);
-    printf("l1d_miss     : %llu\n", s->l1d_miss);
-    printf("llc_miss     : %llu\n", s->llc_miss);
-    printf("cycles       : %llu\n\n", s->cycles);
+    int i;
+
+    for (i = 0; i < NR_GENERATORS; i++) {
+        if (!strcmp(generators[i].name, name))
+            return i;
+    }
+    return -1;
 }
 
-int main(void)
+static void usage(const char *prog)
 {
-    int *arr;
-    struct pmu_stats seq_stats, rand_stats;
+    int i;
+
+    fprintf(stderr,
+            "usage: %s [-g generator,...] [-a policy]\n"
+            "       %s -c min:max [-a policy]\n"
+            "       %s -m size [-a policy]\n"
+            "       %s -p size [-a policy]\n"
+            "  -c  pointer-chase latency from min to max bytes (4K:1G), CSV out\n"
+            "  -m  interleaved chains and prefetch distances over size bytes, CSV out\n"
+            "  -p  forward, backward and tiled strides over size bytes, CSV out\n"
+            "  -a  buffer allocation, %s (default malloc)\n"
+            "  -H  same as -a thp\n"
+            "generators:", prog, prog, prog, prog, bench_alloc_names());
+    for (i = 0; i < NR_GENERATORS; i++)
+        fprintf(stderr, " %s", generators[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int *arr = NULL;
+    struct pmu *pmu = NULL;
+    struct pmu_snapshot seq_snap, rand_snap, gen_snap;
+    struct pmu_event_config saved;
     long long sum = 0;
-    size_t i;
+    int selected[NR_GENERATORS];
+    int nr_selected = 0, phase = 2, g, opt, policy = BENCH_ALLOC_MALLOC;
+    int tlb = 0, reprogrammed = 0, ret = 1;
+    char label[96], *list = NULL, *tok, *end;
+    size_t i, chase_min = 0, chase_max = 0, mlp_size = 0, pattern_size = 0;
+    size_t n = ARRAY_SIZE;
 
-    arr = malloc(sizeof(int) * ARRAY_SIZE);
-    if (!arr) {
-        perror("malloc");
+    while ((opt = getopt(argc, argv, "g:c:m:p:a:H")) != -1) {
+        switch (opt) {
+        case 'g': list = optarg; break;
+        case 'c':
+            chase_min = parse_size(optarg, &end);
+            if (*end++ != ':')
+                usage(argv[0]);
+            chase_max = parse_size(end, &end);
+            if (*end || !chase_min || chase_max < chase_min)
+                usage(argv[0]);
+            break;
+        case 'm':
+            mlp_size = parse_size(optarg, &end);
+            if (*end || !mlp_size)
+                usage(argv[0]);
+            break;
+        case 'p':
+            pattern_size = parse_size(optarg, &end);
+            if (*end || !pattern_size)
+                usage(argv[0]);
+            break;
+        case 'a':
+            policy = bench_alloc_parse(optarg);
+            if (policy < 0)
+                usage(argv[0]);
+            tlb = 1;
+            break;
+        case 'H': policy = BENCH_ALLOC_THP; tlb = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (list) {
+        for (tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+            g = find_generator(tok);
+            if (g < 0 || nr_selected == NR_GENERATORS)
+                usage(argv[0]);
+            selected[nr_selected++] = g;
+        }
+    } else {
+        for (g = 0; g < NR_GENERATORS; g++)
+            selected[nr_selected++] = g;
+    }
+
+    pmu = pmu_open();
+    if (!pmu) {
+        perror("pmu_open");
         return 1;
     }
 
+    if (tlb) {
+        if (bench_tlb_events(pmu, &saved) < 0) {
+            perror("pmu_set_events");
+            goto out;
+        }
+        reprogrammed = 1;
+    }
+
+    if (chase_min || mlp_size || pattern_size) {
+        if (chase_min)
+            ret = run_chase(pmu, chase_min, chase_max, policy);
+        else if (mlp_size)
+            ret = run_mlp(pmu, mlp_size, policy);
+        else
+            ret = run_patterns(pmu, pattern_size, policy);
+        ret = ret ? 1 : 0;
+        goto out;
+    }
+
+    arr = bench_alloc(sizeof(int) * ARRAY_SIZE, policy);
+    if (!arr) {
+        perror(bench_alloc_name(policy));
+        goto out;
+    }
+
     printf("[Init] Filling array sequentially...\n");
     for (i = 0; i < ARRAY_SIZE; i++)
         arr[i] = (int)i;
 
-    printf("Array size: %zu ints (%.1f MB)\n",
+    printf("Array size: %zu ints (%.1f MB, %s)\n",
            (size_t)ARRAY_SIZE,
-           (double)ARRAY_SIZE * sizeof(int) / (1024.0 * 1024.0));
+           (double)ARRAY_SIZE * sizeof(int) / (1024.0 * 1024.0),
+           bench_alloc_name(policy));
+    /* the generators get the size as an unknown, see DEFINE_ACCESS */
+    OPAQUE(n);
+    printf("Index reduction: %% divides by the run-time size, _mask uses & (size - 1), "
+           "rand keeps %% ARRAY_SIZE\n");
+
 
-    
     printf("[Phase 1] Sequential scan...\n");
 
-    if (pmu_control("start\n") < 0) goto out;
+    if (pmu_start(pmu) < 0) goto pmu_fail;
     for (i = 0; i < ARRAY_SIZE; i++)
         sum += arr[i];
-    if (pmu_control("stop\n") < 0) goto out;
+    if (pmu_stop(pmu, &seq_snap) < 0) goto pmu_fail;
+    print_stats("Phase 1 (sequential access)", &seq_snap);
 
-    if (pmu_read_stats(&seq_stats) < 0) goto out;
-    print_stats("Phase 1 (sequential access)", &seq_stats);
+    for (g = 0; g < nr_selected; g++, phase++) {
+        const struct generator *gen = &generators[selected[g]];
 
-    
-    printf("[Phase 2] Random access...\n");
-    srand((unsigned)time(NULL));
+        if (gen->fn == access_perm && !perm && !(perm = make_perm(ARRAY_SIZE))) {
+            perror("malloc");
+            goto out;
+        }
 
-    if (pmu_control("start\n") < 0) goto out;
-    for (i = 0; i < RANDOM_ITERS; i++) {
-        size_t idx = (size_t) (rand() % ARRAY_SIZE);
-        sum += arr[idx];
-    }
-    if (pmu_control("stop\n") < 0) goto out;
+        printf("[Phase %d] Random access (%s)...\n", phase, gen->name);
 
-    if (pmu_read_stats(&rand_stats) < 0) goto out;
-    print_stats("Phase 2 (random access)", &rand_stats);
+        if (pmu_start(pmu) < 0) goto pmu_fail;
+        sum += gen->fn(arr, n, RANDOM_ITERS, 1);
+        if (pmu_stop(pmu, &rand_snap) < 0) goto pmu_fail;
+
+        /* the same generator without the loads, not a phase of its own */
+        if (pmu_start(pmu) < 0) goto pmu_fail;
+        sum += gen->fn(arr, n, RANDOM_ITERS, 0);
+        if (pmu_stop(pmu, &gen_snap) < 0) goto pmu_fail;
+
+        /* rand keeps the label part4.py always plotted */
+        if (!strcmp(gen->name, "rand"))
+            snprintf(label, sizeof(label), "Phase %d (random access)", phase);
+        else
+            snprintf(label, sizeof(label), "Phase %d (random access, %s)",
+                     phase, gen->name);
+        print_stats(label, &rand_snap);
+        print_split(&rand_snap, &gen_snap);
+    }
 
     printf("Final sum (to avoid optimization): %lld\n", sum);
+    ret = 0;
 
+    goto out;
+
+pmu_fail:
+    perror("pmu");
 out:
-    free(arr);
-    return 0;
+    if (reprogrammed && bench_restore_events(pmu, &saved) < 0)
+        perror("pmu_set_events");
+    pmu_close(pmu);
+    free(perm);
+    bench_free(arr, sizeof(int) * ARRAY_SIZE, policy);
+    return ret;
 }
@@ -0,0 +1,352 @@
+#ifndef PMU_BACKEND_H
+#define PMU_BACKEND_H
+
+/*
+ * Register backends for part1 and part3. Every counter register access in
+ * both modules goes through pmu_ops, so the control logic can run against
+ * the real ARMv8 PMU or against a software model of it on any Linux host
+ * ("backend=sim").
+ */
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#else
+/* pmu_sim_test.c: the includer defines the kernel types and macros used here */
+#include <string.h>
+#endif
+
+struct pmu_backend_ops {
+    const char *name;
+    bool has_irq;       /* overflow interrupts can be requested from the DT */
+    u64 (*read_pmcr_el0)(void);
+    void (*write_pmcr_el0)(u64 val);
+    void (*write_pmselr_el0)(u64 val);
+    void (*write_pmxevtyper_el0)(u64 val);
+    void (*write_pmxevcntr_el0)(u64 val);
+    u64 (*read_pmxevcntr_el0)(void);
+    u64 (*read_pmccntr_el0)(void);
+    void (*write_pmcntenset_el0)(u64 val);
+    void (*write_pmcntenclr_el0)(u64 val);
+    u64 (*read_pmovsclr_el0)(void);
+    void (*write_pmovsclr_el0)(u64 val);
+    void (*write_pmintenset_el1)(u64 val);
+    void (*write_pmintenclr_el1)(u64 val);
+    void (*write_pmuserenr_el0)(u64 val);
+};
+
+#ifdef CONFIG_ARM64
+#include <asm/barrier.h>
+
+static void armv8_write_pmselr_el0(u64 val)
+{
+    asm volatile("msr pmselr_el0, %0" :: "r"(val));
+    isb();
+}
+
+static void armv8_write_pmxevtyper_el0(u64 val)
+{
+    asm volatile("msr pmxevtyper_el0, %0" :: "r"(val));
+    isb();
+}
+
+static void armv8_write_pmxevcntr_el0(u64 val)
+{
+    asm volatile("msr pmxevcntr_el0, %0" :: "r"(val));
+    isb();
+}
+
+static u64 armv8_read_pmxevcntr_el0(void)
+{
+    u64 val;
+
+    asm volatile("mrs %0, pmxevcntr_el0" : "=r"(val));
+    return val;
+}
+
+static u64 armv8_read_pmccntr_el0(void)
+{
+    u64 val;
+
+    asm volatile("mrs %0, pmccntr_el0" : "=r"(val));
+    return val;
+}
+
+static u64 armv8_read_pmcr_el0(void)
+{
+    u64 val;
+
+    asm volatile("mrs %0, pmcr_el0" : "=r"(val));
+    return val;
+}
+
+static void armv8_write_pmcr_el0(u64 val)
+{
+    asm volatile("msr pmcr_el0, %0" :: "r"(val));
+    isb();
+}
+
+static void armv8_write_pmcntenset_el0(u64 val)
+{
+    asm volatile("msr pmcntenset_el0, %0" :: "r"(val));
+    isb();
+}
+
+static void armv8_write_pmcntenclr_el0(u64 val)
+{
+    asm volatile("msr pmcntenclr_el0, %0" :: "r"(val));
+    isb();
+}
+
+static void armv8_write_pmovsclr_el0(u64 val)
+{
+    asm volatile("msr pmovsclr_el0, %0" :: "r"(val));
+    isb();
+}
+
+static u64 armv8_read_pmovsclr_el0(void)
+{
+    u64 val;
+
+    asm volatile("mrs %0, pmovsclr_el0" : "=r"(val));
+    return val;
+}
+
+static void armv8_write_pmintenset_el1(u64 val)
+{
+    asm volatile("msr pmintenset_el1, %0" :: "r"(val));
+    isb();
+}
+
+static void armv8_write_pmintenclr_el1(u64 val)
+{
+    asm volatile("msr pmintenclr_el1, %0" :: "r"(val));
+    isb();
+}
+
+static void armv8_write_pmuserenr_el0(u64 val)
+{
+    asm volatile("msr pmuserenr_el0, %0" :: "r"(val));
+    isb();
+}
+
+static const struct pmu_backend_ops pmu_armv8_ops = {
+    .name                 = "armv8",
+    .has_irq              = true,
+    .read_pmcr_el0        = armv8_read_pmcr_el0,
+    .write_pmcr_el0       = armv8_write_pmcr_el0,
+    .write_pmselr_el0     = armv8_write_pmselr_el0,
+    .write_pmxevtyper_el0 = armv8_write_pmxevtyper_el0,
+    .write_pmxevcntr_el0  = armv8_write_pmxevcntr_el0,
+    .read_pmxevcntr_el0   = armv8_read_pmxevcntr_el0,
+    .read_pmccntr_el0     = armv8_read_pmccntr_el0,
+    .write_pmcntenset_el0 = armv8_write_pmcntenset_el0,
+    .write_pmcntenclr_el0 = armv8_write_pmcntenclr_el0,
+    .read_pmovsclr_el0    = armv8_read_pmovsclr_el0,
+    .write_pmovsclr_el0   = armv8_write_pmovsclr_el0,
+    .write_pmintenset_el1 = armv8_write_pmintenset_el1,
+    .write_pmintenclr_el1 = armv8_write_pmintenclr_el1,
+    .write_pmuserenr_el0  = armv8_write_pmuserenr_el0,
+};
+#endif /* CONFIG_ARM64 */
+
+/*
+ * Software model of one Cortex-A72 PMU per cpu. Time does not exist in
+ * it: every read of a counter advances the enabled counters by a fixed
+ * step (cycles) and a fixed per-event share of it, so a given sequence of
+ * register accesses always produces the same counts. Event counters are
+ * 32 bits and set their overflow bit when they wrap, so a large step
+ * exercises the overflow folding quickly. No interrupts are raised.
+ */
+#define SIM_NR_COUNTERS 6
+#define SIM_PMCR_E      BIT(0)
+#define SIM_PMCR_P      BIT(1)
+#define SIM_PMCR_C      BIT(2)
+#define SIM_PMCR_LC     BIT(6)
+#define SIM_CYCLE_BIT   31
+
+struct pmu_sim_cpu {
+    u64 pmcr;
+    u32 sel;
+    u32 evtyper[SIM_NR_COUNTERS];
+    u32 evcntr[SIM_NR_COUNTERS];
+    u64 ccntr;
+    u32 cnten;
+    u32 ovs;
+    u32 inten;
+    u32 userenr;    /* stored only, nothing runs at EL0 against the model */
+};
+
+static DEFINE_PER_CPU(struct pmu_sim_cpu, pmu_sim_cpu);
+static unsigned int pmu_sim_step = 1000;
+
+/* events per 16 cycles; a made-up but fixed workload with IPC 1 */
+static u32 pmu_sim_rate(u32 event)
+{
+    switch (event) {
+    case 0x08: return 16;   /* INST_RETIRED */
+    case 0x11: return 16;   /* CPU_CYCLES */
+    case 0x14: return 4;    /* L1I_CACHE */
+    case 0x04: return 6;    /* L1D_CACHE */
+    case 0x03: return 1;    /* L1D_CACHE_REFILL */
+    case 0x16: return 1;    /* L2D_CACHE */
+    case 0x00: return 0;    /* SW_INCR */
+    default:   return 2;
+    }
+}
+
+static void pmu_sim_advance(struct pmu_sim_cpu *sim)
+{
+    u32 i, old;
+
+    if (!(sim->pmcr & SIM_PMCR_E))
+        return;
+
+    if (sim->cnten & BIT(SIM_CYCLE_BIT)) {
+        sim->ccntr += pmu_sim_step;
+        if (!(sim->pmcr & SIM_PMCR_LC) && sim->ccntr > U32_MAX) {
+            sim->ccntr = (u32)sim->ccntr;
+            sim->ovs |= BIT(SIM_CYCLE_BIT);
+        }
+    }
+
+    for (i = 0; i < SIM_NR_COUNTERS; i++) {
+        if (!(sim->cnten & BIT(i)))
+            continue;
+        old = sim->evcntr[i];
+        sim->evcntr[i] += (u32)(((u64)pmu_sim_step * pmu_sim_rate(sim->evtyper[i])) / 16);
+        if (sim->evcntr[i] < old)
+            sim->ovs |= BIT(i);
+    }
+}
+
+static u64 sim_read_pmcr_el0(void)
+{
+    return this_cpu_ptr(&pmu_sim_cpu)->pmcr | (SIM_NR_COUNTERS << 11);
+}
+
+static void sim_write_pmcr_el0(u64 val)
+{
+    struct pmu_sim_cpu *sim = this_cpu_ptr(&pmu_sim_cpu);
+
+    if (val & SIM_PMCR_P)
+        memset(sim->evcntr, 0, sizeof(sim->evcntr));
+    if (val & SIM_PMCR_C)
+        sim->ccntr = 0;
+    sim->pmcr = val & (SIM_PMCR_E | SIM_PMCR_LC);
+}
+
+static void sim_write_pmselr_el0(u64 val)
+{
+    this_cpu_ptr(&pmu_sim_cpu)->sel = val & 0x1f;
+}
+
+static void sim_write_pmxevtyper_el0(u64 val)
+{
+    struct pmu_sim_cpu *sim = this_cpu_ptr(&pmu_sim_cpu);
+
+    if (sim->sel < SIM_NR_COUNTERS)
+        sim->evtyper[sim->sel] = val & 0xffff;
+}
+
+static void sim_write_pmxevcntr_el0(u64 val)
+{
+    struct pmu_sim_cpu *sim = this_cpu_ptr(&pmu_sim_cpu);
+
+    if (sim->sel < SIM_NR_COUNTERS)
+        sim->evcntr[sim->sel] = val;
+}
+
+static u64 sim_read_pmxevcntr_el0(void)
+{
+    struct pmu_sim_cpu *sim = this_cpu_ptr(&pmu_sim_cpu);
+
+    if (sim->sel >= SIM_NR_COUNTERS)
+        return 0;
+    pmu_sim_advance(sim);
+    return sim->evcntr[sim->sel];
+}
+
+static u64 sim_read_pmccntr_el0(void)
+{
+    struct pmu_sim_cpu *sim = this_cpu_ptr(&pmu_sim_cpu);
+
+    pmu_sim_advance(sim);
+    return sim->ccntr;
+}
+
+static void sim_write_pmcntenset_el0(u64 val)
+{
+    this_cpu_ptr(&pmu_sim_cpu)->cnten |= val;
+}
+
+static void sim_write_pmcntenclr_el0(u64 val)
+{
+    this_cpu_ptr(&pmu_sim_cpu)->cnten &= ~val;
+}
+
+static u64 sim_read_pmovsclr_el0(void)
+{
+    return this_cpu_ptr(&pmu_sim_cpu)->ovs;
+}
+
+static void sim_write_pmovsclr_el0(u64 val)
+{
+    this_cpu_ptr(&pmu_sim_cpu)->ovs &= ~val;
+}
+
+static void sim_write_pmintenset_el1(u64 val)
+{
+    this_cpu_ptr(&pmu_sim_cpu)->inten |= val;
+}
+
+static void sim_write_pmintenclr_el1(u64 val)
+{
+    this_cpu_ptr(&pmu_sim_cpu)->inten &= ~val;
+}
+
+static void sim_write_pmuserenr_el0(u64 val)
+{
+    this_cpu_ptr(&pmu_sim_cpu)->userenr = val;
+}
+
+static const struct pmu_backend_ops pmu_sim_ops = {
+    .name                 = "sim",
+    .has_irq              = false,
+    .read_pmcr_el0        = sim_read_pmcr_el0,
+    .write_pmcr_el0       = sim_write_pmcr_el0,
+    .write_pmselr_el0     = sim_write_pmselr_el0,
+    .write_pmxevtyper_el0 = sim_write_pmxevtyper_el0,
+    .write_pmxevcntr_el0  = sim_write_pmxevcntr_el0,
+    .read_pmxevcntr_el0   = sim_read_pmxevcntr_el0,
+    .read_pmccntr_el0     = sim_read_pmccntr_el0,
+    .write_pmcntenset_el0 = sim_write_pmcntenset_el0,
+    .write_pmcntenclr_el0 = sim_write_pmcntenclr_el0,
+    .read_pmovsclr_el0    = sim_read_pmovsclr_el0,
+    .write_pmovsclr_el0   = sim_write_pmovsclr_el0,
+    .write_pmintenset_el1 = sim_write_pmintenset_el1,
+    .write_pmintenclr_el1 = sim_write_pmintenclr_el1,
+    .write_pmuserenr_el0  = sim_write_pmuserenr_el0,
+};
+
+#ifdef CONFIG_ARM64
+#define PMU_BACKEND_DEFAULT "armv8"
+#else
+#define PMU_BACKEND_DEFAULT "sim"
+#endif
+
+/* the backend= module parameter; NULL if there is no such backend here */
+static const struct pmu_backend_ops *pmu_backend_find(const char *name)
+{
+#ifdef CONFIG_ARM64
+    if (!strcmp(name, "armv8"))
+        return &pmu_armv8_ops;
+#endif
+    if (!strcmp(name, "sim"))
+        return &pmu_sim_ops;
+    return NULL;
+}
+
+#endif /* PMU_BACKEND_H */
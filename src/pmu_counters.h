@@ -0,0 +1,326 @@
+#ifndef PMU_COUNTERS_H
+#define PMU_COUNTERS_H
+
+/*
+ * The counter core of part3: register access through pmu_ops, event
+ * groups, 32-bit overflow folding, group rotation, per-cpu reset and the
+ * local read, plus the multiplex scaling. Everything here runs on the
+ * owning cpu.
+ *
+ * part3.c includes this after struct pmu_cpu_state, the per-cpu
+ * pmu_cpu_state, pmu_ops, pmu_config, pmu_nr_counters, pmu_irq_enabled,
+ * the pmu_sample_* settings and the PMCR bit definitions.
+ * src/pmu_sim_test.c provides the same names in userspace to run this
+ * code against the sim backend.
+ */
+
+static inline void write_pmselr_el0(u64 val)
+{
+    pmu_ops->write_pmselr_el0(val);
+}
+
+static inline void write_pmxevtyper_el0(u64 val)
+{
+    pmu_ops->write_pmxevtyper_el0(val);
+}
+
+static inline void write_pmxevcntr_el0(u64 val)
+{
+    pmu_ops->write_pmxevcntr_el0(val);
+}
+
+static inline u64 read_pmxevcntr_el0(void)
+{
+    return pmu_ops->read_pmxevcntr_el0();
+}
+
+static inline u64 read_pmccntr_el0(void)
+{
+    return pmu_ops->read_pmccntr_el0();
+}
+
+static inline u64 read_pmcr_el0(void)
+{
+    return pmu_ops->read_pmcr_el0();
+}
+
+static inline void write_pmcr_el0(u64 val)
+{
+    pmu_ops->write_pmcr_el0(val);
+}
+
+static inline void write_pmcntenset_el0(u64 val)
+{
+    pmu_ops->write_pmcntenset_el0(val);
+}
+
+static inline void write_pmcntenclr_el0(u64 val)
+{
+    pmu_ops->write_pmcntenclr_el0(val);
+}
+
+static inline void write_pmovsclr_el0(u64 val)
+{
+    pmu_ops->write_pmovsclr_el0(val);
+}
+
+static inline u64 read_pmovsclr_el0(void)
+{
+    return pmu_ops->read_pmovsclr_el0();
+}
+
+static inline void write_pmintenset_el1(u64 val)
+{
+    pmu_ops->write_pmintenset_el1(val);
+}
+
+static inline void write_pmintenclr_el1(u64 val)
+{
+    pmu_ops->write_pmintenclr_el1(val);
+}
+
+static inline void write_pmuserenr_el0(u64 val)
+{
+    pmu_ops->write_pmuserenr_el0(val);
+}
+
+static inline u64 read_event_counter(u32 counter)
+{
+    write_pmselr_el0(counter);
+    return read_pmxevcntr_el0();
+}
+
+static void pmu_program_counter(u32 counter, u32 event)
+{
+    write_pmselr_el0(counter);
+    write_pmxevtyper_el0(event);
+    write_pmxevcntr_el0(0);
+}
+
+/*
+ * When more events are configured than there are counters, they are
+ * split into groups that take turns on the hardware. A group uses every
+ * counter except the one reserved for sampling.
+ */
+static inline u32 pmu_group_width(void)
+{
+    return pmu_nr_counters - (pmu_sample_mask ? 1 : 0);
+}
+
+static inline u32 pmu_nr_groups(void)
+{
+    return max_t(u32, DIV_ROUND_UP(pmu_config.nr_events, pmu_group_width()), 1);
+}
+
+static inline u32 pmu_group_first(u32 group)
+{
+    return group * pmu_group_width();
+}
+
+static inline u32 pmu_group_size(u32 group)
+{
+    u32 first = pmu_group_first(group);
+
+    if (first >= pmu_config.nr_events)
+        return 0;
+    return min(pmu_config.nr_events - first, pmu_group_width());
+}
+
+static inline u32 pmu_group_mask(u32 group)
+{
+    return (u32)(BIT_ULL(pmu_group_size(group)) - 1);
+}
+
+
+
+/*
+ * The event counters are 32 bits wide. Each wrap sets its PMOVSSET bit;
+ * folding adds 2^32 to the per-cpu software extension and clears the bit.
+ * With the overflow interrupt the fold happens right away, otherwise the
+ * publish timer polls often enough that a counter cannot wrap twice.
+ * The cycle counter runs in 64-bit mode (PMCR.LC) and never needs it.
+ * The sampling counter's overflow is left for pmu_sample_overflow().
+ */
+static void pmu_fold_overflow(struct pmu_cpu_state *st)
+{
+    unsigned long ovs = read_pmovsclr_el0() &
+                        ((EVENT_COUNTERS_ALL & ~pmu_sample_mask) | PMU_CYCLE_COUNTER);
+    unsigned int counter;
+
+    if (!ovs)
+        return;
+
+    write_pmovsclr_el0(ovs);
+
+    for_each_set_bit(counter, &ovs, PMU_MAX_EVENTS - 1)
+        st->overflow[counter] += BIT_ULL(32);
+}
+
+/* everything below runs on the owning cpu with irqs off */
+static void pmu_read_group(struct pmu_cpu_state *st, u64 *vals)
+{
+    u32 n = pmu_group_size(st->group);
+    u64 raw[PMU_MAX_EVENTS];
+    u32 counter;
+
+    /* re-read if a counter wrapped between the fold and its read */
+    do {
+        pmu_fold_overflow(st);
+        for (counter = 0; counter < n; counter++)
+            raw[counter] = read_event_counter(counter);
+    } while (read_pmovsclr_el0() & pmu_group_mask(st->group));
+
+    for (counter = 0; counter < n; counter++)
+        vals[counter] = st->overflow[counter] + raw[counter];
+}
+
+static void pmu_sched_in(struct pmu_cpu_state *st, u32 group, u64 now)
+{
+    u32 first = pmu_group_first(group);
+    u32 n = pmu_group_size(group);
+    u32 all = EVENT_COUNTERS_ALL & ~pmu_sample_mask;
+    u32 counter;
+
+    write_pmcntenclr_el0(all);
+    write_pmintenclr_el1(all);
+    write_pmovsclr_el0(all);
+    memset(st->overflow, 0, sizeof(st->overflow));
+
+    for (counter = 0; counter < n; counter++)
+        pmu_program_counter(counter, pmu_config.event[first + counter]);
+
+    st->group = group;
+    st->group_since = now;
+
+    if (pmu_irq_enabled)
+        write_pmintenset_el1(pmu_group_mask(group));
+    write_pmcntenset_el0(pmu_group_mask(group));
+}
+
+static void pmu_sched_out(struct pmu_cpu_state *st, u64 now)
+{
+    u32 first = pmu_group_first(st->group);
+    u32 n = pmu_group_size(st->group);
+    u64 vals[PMU_MAX_EVENTS];
+    u32 counter;
+
+    write_pmcntenclr_el0(EVENT_COUNTERS_ALL & ~pmu_sample_mask);
+    pmu_read_group(st, vals);
+
+    for (counter = 0; counter < n; counter++)
+        st->accum[first + counter] += vals[counter];
+    st->time_running[st->group] += now - st->group_since;
+}
+
+/* the next group takes over the counters; from the mux timer */
+static void pmu_rotate(struct pmu_cpu_state *st, u64 now)
+{
+    pmu_sched_out(st, now);
+    pmu_sched_in(st, (st->group + 1) % pmu_nr_groups(), now);
+}
+
+/*
+ * Sampling. The reserved counter is preloaded with -period so it wraps
+ * after period events; its overflow irq records where the cpu was and
+ * rearms it.
+ */
+static void pmu_sample_arm(void)
+{
+    if (!pmu_sample_mask)
+        return;
+
+    pmu_program_counter(pmu_sample_counter, pmu_sample_event);
+    write_pmxevcntr_el0((u32)-pmu_sample_period);
+    write_pmovsclr_el0(pmu_sample_mask);
+    write_pmintenset_el1(pmu_sample_mask);
+    write_pmcntenset_el0(pmu_sample_mask);
+}
+
+static void pmu_reset_cpu(void *unused)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    u64 now = ktime_get_ns();
+
+    write_pmcntenclr_el0(EVENT_COUNTERS_ALL | PMU_CYCLE_COUNTER);
+    write_pmovsclr_el0(~0U);
+
+    write_pmcr_el0(PMU_ENABLE_BIT | PMU_RESET_EVENTS | PMU_RESET_CYCLES |
+                   PMU_LONG_CYCLES);
+
+    memset(st->accum, 0, sizeof(st->accum));
+    memset(st->time_running, 0, sizeof(st->time_running));
+    st->time_enabled = 0;
+    st->enabled_since = now;
+    st->active = true;
+    st->epoch++;
+
+    pmu_sched_in(st, 0, now);
+    pmu_sample_arm();
+    write_pmcntenset_el0(PMU_CYCLE_COUNTER);
+}
+
+static void pmu_disable_cpu(void *unused)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    u64 now = ktime_get_ns();
+
+    write_pmcntenclr_el0(PMU_CYCLE_COUNTER | pmu_sample_mask);
+    if (!st->active)
+        return;
+
+    pmu_sched_out(st, now);
+    st->time_enabled += now - st->enabled_since;
+    st->active = false;
+}
+
+/* raw (unscaled) counts; time_running tells how long each event was on a counter */
+static void pmu_read_local(struct pmu_counts *snapshot)
+{
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    u64 vals[PMU_MAX_EVENTS];
+    unsigned long flags;
+    u32 first, n, i;
+    u64 now;
+
+    local_irq_save(flags);
+    now = ktime_get_ns();
+    first = pmu_group_first(st->group);
+    n = pmu_group_size(st->group);
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (i = 0; i < pmu_config.nr_events; i++) {
+        snapshot->event[i] = st->accum[i];
+        snapshot->time_running[i] = st->time_running[i / pmu_group_width()];
+    }
+    snapshot->time_enabled = st->time_enabled;
+
+    if (st->active) {
+        pmu_read_group(st, vals);
+        for (i = 0; i < n; i++) {
+            snapshot->event[first + i] += vals[i];
+            snapshot->time_running[first + i] += now - st->group_since;
+        }
+        snapshot->time_enabled += now - st->enabled_since;
+    }
+    snapshot->cycles = read_pmccntr_el0();
+
+    local_irq_restore(flags);
+}
+
+/* multiplexed events are estimated as count * enabled / running, like perf */
+static void pmu_scale_counts(struct pmu_counts *counts, u32 nr_events)
+{
+    u32 i;
+
+    for (i = 0; i < nr_events; i++) {
+        if (!counts->time_running[i]) {
+            counts->event[i] = 0;
+        } else if (counts->time_running[i] < counts->time_enabled) {
+            counts->event[i] = mul_u64_u64_div_u64(counts->event[i],
+                                                   counts->time_enabled,
+                                                   counts->time_running[i]);
+        }
+    }
+}
+
+#endif /* PMU_COUNTERS_H */
@@ -0,0 +1,177 @@
+#ifndef PMU_EVENTS_H
+#define PMU_EVENTS_H
+
+/*
+ * ARMv8 PMU event numbers (common events plus the Cortex-A72
+ * implementation defined ones we use), shared by the module and tools.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/types.h>
+#else
+#include <string.h>
+#include <linux/types.h>
+#endif
+
+#define EVT_SW_INCR         0x00
+#define EVT_L1I_REFILL      0x01
+#define EVT_L1I_TLB_REFILL  0x02
+#define EVT_L1D_REFILL      0x03
+#define EVT_L1D_ACCESS      0x04
+#define EVT_L1D_TLB_REFILL  0x05
+#define EVT_LD_RETIRED      0x06
+#define EVT_ST_RETIRED      0x07
+#define EVT_INSTR_RETIRED   0x08
+#define EVT_EXC_TAKEN       0x09
+#define EVT_EXC_RETURN      0x0A
+#define EVT_PC_WRITE        0x0C
+#define EVT_BR_IMMED        0x0D
+#define EVT_BR_RETURN       0x0E
+#define EVT_UNALIGNED_LDST  0x0F
+#define EVT_BR_MIS_PRED     0x10
+#define EVT_CPU_CYCLES      0x11
+#define EVT_BR_PRED         0x12
+#define EVT_MEM_ACCESS      0x13
+#define EVT_L1I_ACCESS      0x14
+#define EVT_L1D_WB          0x15
+#define EVT_L2D_ACCESS      0x16
+#define EVT_LLC_REFILL      0x17    /* L2D_CACHE_REFILL, the last level on the Pi 4 */
+#define EVT_L2D_WB          0x18
+#define EVT_BUS_ACCESS      0x19
+#define EVT_MEM_ERROR       0x1A
+#define EVT_INST_SPEC       0x1B
+#define EVT_TTBR_WRITE      0x1C
+#define EVT_BUS_CYCLES      0x1D
+#define EVT_BR_RETIRED      0x21
+#define EVT_BR_MIS_PRED_RETIRED 0x22
+#define EVT_STALL_FRONTEND  0x23
+#define EVT_STALL_BACKEND   0x24
+#define EVT_L1D_TLB         0x25
+#define EVT_L1I_TLB         0x26
+#define EVT_L2D_TLB_REFILL  0x2D
+#define EVT_L2D_TLB         0x2F
+
+#define EVT_L1D_ACCESS_LD   0x40
+#define EVT_L1D_ACCESS_ST   0x41
+#define EVT_L1D_REFILL_LD   0x42
+#define EVT_L1D_REFILL_ST   0x43
+#define EVT_L1D_TLB_REFILL_LD 0x4C
+#define EVT_L1D_TLB_REFILL_ST 0x4D
+#define EVT_L2D_ACCESS_LD   0x50
+#define EVT_L2D_ACCESS_ST   0x51
+#define EVT_L2D_REFILL_LD   0x52
+#define EVT_L2D_REFILL_ST   0x53
+#define EVT_BUS_ACCESS_LD   0x60
+#define EVT_BUS_ACCESS_ST   0x61
+#define EVT_LD_SPEC         0x70
+#define EVT_ST_SPEC         0x71
+#define EVT_DP_SPEC         0x73
+#define EVT_ASE_SPEC        0x74
+#define EVT_VFP_SPEC        0x75
+
+#define EVT_CODE_MASK       0xffff
+
+/* the six events part1 always counts, in counter order */
+#define PMU_DEFAULT_EVENTS {    \
+    EVT_INSTR_RETIRED,          \
+    EVT_L1I_ACCESS,             \
+    EVT_L1I_REFILL,             \
+    EVT_L1D_ACCESS,             \
+    EVT_L1D_REFILL,             \
+    EVT_LLC_REFILL,             \
+}
+
+struct pmu_event_desc {
+    __u32 code;
+    const char *name;
+};
+
+/*
+ * The default six keep the key names /proc/pmu_stats always used, so
+ * measure.sh and part4.py still find them.
+ */
+static const struct pmu_event_desc pmu_event_table[] = {
+    { EVT_INSTR_RETIRED,     "instructions" },
+    { EVT_L1I_ACCESS,        "l1i_references" },
+    { EVT_L1I_REFILL,        "l1i_misses" },
+    { EVT_L1D_ACCESS,        "l1d_references" },
+    { EVT_L1D_REFILL,        "l1d_misses" },
+    { EVT_LLC_REFILL,        "llc_misses" },
+    { EVT_SW_INCR,           "sw_incr" },
+    { EVT_L1I_TLB_REFILL,    "l1i_tlb_refill" },
+    { EVT_L1D_TLB_REFILL,    "l1d_tlb_refill" },
+    { EVT_LD_RETIRED,        "ld_retired" },
+    { EVT_ST_RETIRED,        "st_retired" },
+    { EVT_EXC_TAKEN,         "exc_taken" },
+    { EVT_EXC_RETURN,        "exc_return" },
+    { EVT_PC_WRITE,          "pc_write" },
+    { EVT_BR_IMMED,          "br_immed" },
+    { EVT_BR_RETURN,         "br_return" },
+    { EVT_UNALIGNED_LDST,    "unaligned_ldst" },
+    { EVT_BR_MIS_PRED,       "br_mis_pred" },
+    { EVT_CPU_CYCLES,        "cpu_cycles" },
+    { EVT_BR_PRED,           "br_pred" },
+    { EVT_MEM_ACCESS,        "mem_access" },
+    { EVT_L1D_WB,            "l1d_wb" },
+    { EVT_L2D_ACCESS,        "l2d_access" },
+    { EVT_L2D_WB,            "l2d_wb" },
+    { EVT_BUS_ACCESS,        "bus_access" },
+    { EVT_MEM_ERROR,         "mem_error" },
+    { EVT_INST_SPEC,         "inst_spec" },
+    { EVT_TTBR_WRITE,        "ttbr_write" },
+    { EVT_BUS_CYCLES,        "bus_cycles" },
+    { EVT_BR_RETIRED,        "br_retired" },
+    { EVT_BR_MIS_PRED_RETIRED, "br_mis_pred_retired" },
+    { EVT_STALL_FRONTEND,    "stall_frontend" },
+    { EVT_STALL_BACKEND,     "stall_backend" },
+    { EVT_L1D_TLB,           "l1d_tlb" },
+    { EVT_L1I_TLB,           "l1i_tlb" },
+    { EVT_L2D_TLB_REFILL,    "l2d_tlb_refill" },
+    { EVT_L2D_TLB,           "l2d_tlb" },
+    { EVT_L1D_ACCESS_LD,     "l1d_access_ld" },
+    { EVT_L1D_ACCESS_ST,     "l1d_access_st" },
+    { EVT_L1D_REFILL_LD,     "l1d_refill_ld" },
+    { EVT_L1D_REFILL_ST,     "l1d_refill_st" },
+    { EVT_L1D_TLB_REFILL_LD, "l1d_tlb_refill_ld" },
+    { EVT_L1D_TLB_REFILL_ST, "l1d_tlb_refill_st" },
+    { EVT_L2D_ACCESS_LD,     "l2d_access_ld" },
+    { EVT_L2D_ACCESS_ST,     "l2d_access_st" },
+    { EVT_L2D_REFILL_LD,     "l2d_refill_ld" },
+    { EVT_L2D_REFILL_ST,     "l2d_refill_st" },
+    { EVT_BUS_ACCESS_LD,     "bus_access_ld" },
+    { EVT_BUS_ACCESS_ST,     "bus_access_st" },
+    { EVT_LD_SPEC,           "ld_spec" },
+    { EVT_ST_SPEC,           "st_spec" },
+    { EVT_DP_SPEC,           "dp_spec" },
+    { EVT_ASE_SPEC,          "ase_spec" },
+    { EVT_VFP_SPEC,          "vfp_spec" },
+};
+
+#define PMU_EVENT_TABLE_SIZE (sizeof(pmu_event_table) / sizeof(pmu_event_table[0]))
+
+/* NULL for codes that are not in the table, print those as hex */
+static inline const char *pmu_event_name(__u32 code)
+{
+    unsigned int i;
+
+    for (i = 0; i < PMU_EVENT_TABLE_SIZE; i++) {
+        if (pmu_event_table[i].code == code)
+            return pmu_event_table[i].name;
+    }
+    return NULL;
+}
+
+/* -1 if the name is unknown */
+static inline int pmu_event_code(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < PMU_EVENT_TABLE_SIZE; i++) {
+        if (!strcmp(pmu_event_table[i].name, name))
+            return pmu_event_table[i].code;
+    }
+    return -1;
+}
+
+#endif /* PMU_EVENTS_H */
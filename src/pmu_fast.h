@@ -0,0 +1,167 @@
+#ifndef PMU_FAST_H
+#define PMU_FAST_H
+
+/*
+ * Direct EL0 counter reads, no syscall. Needs the part3 module loaded with
+ * user_access=1 (or "useraccess on" in /proc/pmu_control), otherwise the
+ * mrs traps and the process gets SIGILL.
+ *
+ * The counters are the cpu's own, system wide and not extended: event
+ * counters are 32 bits, so deltas are taken modulo 2^32 and a region must
+ * stay well below 2^32 events. Counter n holds config.event[n] as long as
+ * no more events are configured than there are counters and sampling is
+ * off (otherwise the module rotates what is programmed).
+ *
+ *     struct pmu_fast_sample a, b, d;
+ *
+ *     pmu_fast_read(&a, 6);
+ *     ... short region ...
+ *     pmu_fast_read(&b, 6);
+ *     if (pmu_fast_delta(&a, &b, 6, &d) == 0)
+ *         use d.cycles, d.event[i]
+ *
+ * A delta is only valid when both reads ran on the same cpu, which the
+ * caller should make likely by pinning the thread.
+ */
+
+/* sched_getcpu() needs _GNU_SOURCE defined before the first system header */
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/types.h>
+
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#include <sys/rseq.h>
+#define PMU_FAST_HAVE_RSEQ 1
+#endif
+
+#define PMU_FAST_MAX_COUNTERS 6
+#define PMU_FAST_RETRIES      8
+
+struct pmu_fast_sample {
+    __u64 cycles;
+    __u64 event[PMU_FAST_MAX_COUNTERS];
+    int cpu;
+};
+
+/* the cpu id the kernel keeps in our rseq area: one load, no syscall */
+static inline int pmu_fast_cpu(void)
+{
+#ifdef PMU_FAST_HAVE_RSEQ
+    if (__rseq_size) {
+        struct rseq *rs = (struct rseq *)((char *)__builtin_thread_pointer() +
+                                          __rseq_offset);
+
+        return (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);
+    }
+#endif
+    return sched_getcpu();
+}
+
+#ifdef __aarch64__
+
+static inline __u64 pmu_fast_cycles(void)
+{
+    __u64 val;
+
+    asm volatile("mrs %0, pmccntr_el0" : "=r"(val));
+    return val;
+}
+
+/* PMEVCNTR<n>_EL0 directly, PMSELR is the kernel's */
+static inline __u64 pmu_fast_counter(unsigned int n)
+{
+    __u64 val = 0;
+
+    switch (n) {
+    case 0: asm volatile("mrs %0, pmevcntr0_el0" : "=r"(val)); break;
+    case 1: asm volatile("mrs %0, pmevcntr1_el0" : "=r"(val)); break;
+    case 2: asm volatile("mrs %0, pmevcntr2_el0" : "=r"(val)); break;
+    case 3: asm volatile("mrs %0, pmevcntr3_el0" : "=r"(val)); break;
+    case 4: asm volatile("mrs %0, pmevcntr4_el0" : "=r"(val)); break;
+    case 5: asm volatile("mrs %0, pmevcntr5_el0" : "=r"(val)); break;
+    }
+    return (__u32)val;
+}
+
+/*
+ * Reads the cycle counter and the first nr event counters of one cpu.
+ * If the thread migrated in between, the set is mixed and is read again.
+ * Returns 0, or -1 if it kept migrating.
+ */
+static inline int pmu_fast_read(struct pmu_fast_sample *s, unsigned int nr)
+{
+    unsigned int i, tries;
+    int cpu;
+
+    if (nr > PMU_FAST_MAX_COUNTERS)
+        nr = PMU_FAST_MAX_COUNTERS;
+
+    for (tries = 0; tries < PMU_FAST_RETRIES; tries++) {
+        cpu = pmu_fast_cpu();
+        asm volatile("isb" ::: "memory");
+        s->cycles = pmu_fast_cycles();
+        for (i = 0; i < nr; i++)
+            s->event[i] = pmu_fast_counter(i);
+        asm volatile("" ::: "memory");
+        s->cpu = pmu_fast_cpu();
+        if (s->cpu == cpu)
+            return 0;
+    }
+    return -1;
+}
+
+#else
+
+/* no EL0 PMU access on this architecture */
+static inline int pmu_fast_read(struct pmu_fast_sample *s, unsigned int nr)
+{
+    (void)nr;
+    s->cpu = -1;
+    return -1;
+}
+
+#endif /* __aarch64__ */
+
+/*
+ * 1 if the reads will not trap: AArch64 and part3 loaded with user access
+ * on. The parameter file follows "useraccess on|off" as well.
+ */
+static inline int pmu_fast_enabled(void)
+{
+#ifdef __aarch64__
+    char c = 0;
+    int fd = open("/sys/module/part3/parameters/user_access", O_RDONLY);
+
+    if (fd < 0)
+        return 0;
+    if (read(fd, &c, 1) != 1)
+        c = 0;
+    close(fd);
+    return c == 'Y';
+#else
+    return 0;
+#endif
+}
+
+/* b - a; -1 if they come from different cpus */
+static inline int pmu_fast_delta(const struct pmu_fast_sample *a,
+                                 const struct pmu_fast_sample *b,
+                                 unsigned int nr, struct pmu_fast_sample *d)
+{
+    unsigned int i;
+
+    if (a->cpu < 0 || a->cpu != b->cpu)
+        return -1;
+    if (nr > PMU_FAST_MAX_COUNTERS)
+        nr = PMU_FAST_MAX_COUNTERS;
+
+    d->cpu = a->cpu;
+    d->cycles = b->cycles - a->cycles;
+    for (i = 0; i < nr; i++)
+        d->event[i] = (__u32)(b->event[i] - a->event[i]);
+    return 0;
+}
+
+#endif /* PMU_FAST_H */
@@ -0,0 +1,168 @@
+#ifndef PMU_IOCTL_H
+#define PMU_IOCTL_H
+
+/*
+ * Binary interface of the pmu module (/dev/pmu).
+ * Shared between src/part3.c and the userspace workloads.
+ */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define PMU_DEV_NAME "pmu"
+#define PMU_DEV_PATH "/dev/" PMU_DEV_NAME
+
+#define PMU_MAX_CPUS    8
+#define PMU_MAX_EVENTS  32
+#define PMU_THREADS_MAX 64
+
+/*
+ * event[i] counts config.event[i], see pmu_events.h for the codes.
+ * With more events than hardware counters the module rotates groups of
+ * them; event[i] is then already scaled by time_enabled / time_running[i]
+ * (both in ns), and running < enabled marks an estimate.
+ */
+struct pmu_counts {
+    __u64 cycles;
+    __u64 event[PMU_MAX_EVENTS];
+    __u64 time_enabled;
+    __u64 time_running[PMU_MAX_EVENTS];
+};
+
+struct pmu_event_config {
+    __u32 nr_events;
+    __u32 event[PMU_MAX_EVENTS];
+};
+
+/* pid 0 counts system wide; otherwise only threads of that process (and descendants) */
+#define PMU_TARGET_CHILDREN (1U << 0)
+
+struct pmu_target {
+    __s32 pid;
+    __u32 flags;
+};
+
+/*
+ * total is summed over the cpus in cpu_mask (all of them unless a cpumask
+ * was set; an offline cpu adds what it counted before it went down),
+ * cpu[] only covers the first PMU_MAX_CPUS. While
+ * running, each cpu publishes its counters periodically; staleness_ns is
+ * the age of the oldest value summed.
+ */
+struct pmu_snapshot {
+    __u32 state;
+    __u32 nr_cpus;
+    __u64 staleness_ns;
+    __u64 cpu_mask;     /* bit n: cpu n is counted (first 64 cpus) */
+    struct pmu_event_config config;
+    struct pmu_target target;
+    struct pmu_counts total;
+    struct pmu_counts cpu[PMU_MAX_CPUS];
+};
+
+/*
+ * Sampling: one counter is taken out of the counting groups and reloaded
+ * so it overflows every period events of the given type. Each overflow
+ * appends a struct pmu_sample to the ring of the cpu it happened on.
+ */
+#define PMU_SAMPLE_MAX_COUNTERS 8
+
+struct pmu_sample_config {
+    __u32 event;
+    __u32 period;       /* 0 turns sampling off */
+    __u32 ring_pages;   /* out: size of one cpu ring in pages */
+    __u32 nr_cpus;      /* out: rings that can be mapped */
+};
+
+/* counter[i] is the raw count of config.event[first + i] on that cpu */
+struct pmu_sample {
+    __u64 pc;
+    __u64 time_ns;      /* ktime_get_ns() */
+    __u32 pid;          /* thread id */
+    __u32 tgid;
+    __u32 cpu;
+    __u32 user;         /* pc is a userspace address */
+    __u32 first;
+    __u32 nr;
+    __u64 cycles;
+    __u64 counter[PMU_SAMPLE_MAX_COUNTERS];
+};
+
+/*
+ * mmap(fd, ring_pages * page size, offset cpu * ring_pages * page size)
+ * maps the ring of one cpu: this header page, then nr_records samples at
+ * data_offset. head and tail count records and only ever grow; record n
+ * lives in slot n % nr_records. The module is the only writer of head and
+ * lost, the reader the only writer of tail. Read head with acquire and
+ * store tail with release; a full ring drops new samples into lost.
+ */
+struct pmu_ring_header {
+    __u32 nr_records;
+    __u32 record_size;
+    __u32 data_offset;
+    __u32 pad;
+    __u64 head;
+    __u64 lost;
+    __u64 tail __attribute__((aligned(64)));
+};
+
+/*
+ * Interval mode: every interval_us each running cpu appends the change of
+ * its counters since the previous tick. read() on /dev/pmu returns whole
+ * records and blocks until one is available (poll() works too).
+ */
+#define PMU_INTERVAL_MIN_US 100
+#define PMU_INTERVAL_MAX_US 1000000
+
+/* delta is raw: scale event[i] by time_enabled / time_running[i] when multiplexed */
+struct pmu_interval {
+    __u64 time_ns;      /* ktime_get_ns() at the end of the interval */
+    __u32 cpu;
+    __u32 nr_events;
+    __u64 lost;         /* records this cpu dropped so far, reader too slow */
+    struct pmu_counts delta;
+};
+
+/*
+ * The calling cpu's counters read live, not the published copy, and raw
+ * like the interval deltas. switches is the calling thread's context
+ * switch count, read together with the counters. While cpu and switches
+ * stay the same, the difference of two reads belongs to this thread alone.
+ *
+ * thread is what the calling thread itself counted since its first local
+ * snapshot on this file, on every cpu it ran on, also raw: the module adds
+ * the cpu's counts at each switch-out. restarts counts the stints that
+ * were cut short because the counters restarted under them. tracked is 0
+ * when all PMU_THREADS_MAX thread slots are taken; thread is empty then.
+ */
+struct pmu_local_snapshot {
+    __u32 cpu;
+    __u32 active;       /* this cpu is counting */
+    __u64 switches;
+    struct pmu_counts counts;
+    __u32 tracked;
+    __u32 restarts;
+    struct pmu_counts thread;
+};
+
+#define PMU_IOC_MAGIC    'p'
+#define PMU_IOC_SNAPSHOT _IOR(PMU_IOC_MAGIC, 0, struct pmu_snapshot)
+/* same as writing "start" / "stop" to /proc/pmu_control */
+#define PMU_IOC_START    _IO(PMU_IOC_MAGIC, 1)
+#define PMU_IOC_STOP     _IO(PMU_IOC_MAGIC, 2)
+/* stop every cpu and read it inside the same IPI */
+#define PMU_IOC_STOP_SNAPSHOT _IOR(PMU_IOC_MAGIC, 3, struct pmu_snapshot)
+/* reprogram the counters (multiplexed beyond PMCR_EL0.N events) and restart them */
+#define PMU_IOC_SET_EVENTS _IOW(PMU_IOC_MAGIC, 4, struct pmu_event_config)
+/* count only one process, restarts the counters */
+#define PMU_IOC_SET_TARGET _IOW(PMU_IOC_MAGIC, 5, struct pmu_target)
+/* arm (period != 0) or disarm the sampling counter, restarts the counters */
+#define PMU_IOC_SET_SAMPLING _IOWR(PMU_IOC_MAGIC, 6, struct pmu_sample_config)
+/* interval in us (0 = off), restarts the counters */
+#define PMU_IOC_SET_INTERVAL _IOW(PMU_IOC_MAGIC, 7, __u32)
+/* program, read and sum only the cpus whose bit is set (0 = all), restarts the counters */
+#define PMU_IOC_SET_CPUMASK _IOW(PMU_IOC_MAGIC, 8, __u64)
+/* read the calling cpu without an IPI and without stopping anything */
+#define PMU_IOC_SNAPSHOT_LOCAL _IOR(PMU_IOC_MAGIC, 9, struct pmu_local_snapshot)
+
+#endif /* PMU_IOCTL_H */
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "libpmu.h"
+#include "pmu_region.h"
+
+struct region {
+    char *name;             /* NULL: free slot */
+    unsigned long long calls;
+    unsigned long long dropped; /* counters reset or thread rebased inside */
+    unsigned long long stale;   /* shorter than the age of its snapshots */
+    __u64 cycles;
+    __u64 self_cycles;
+    __u64 min_cycles;
+    __u64 max_cycles;
+    __u64 wall_ns;
+    __u64 event[PMU_MAX_EVENTS];
+};
+
+struct frame {
+    struct region *region;
+    __u64 wall_ns;
+    __u64 staleness_ns;
+    __u64 rebases;          /* t->ctx.rebases after the begin read */
+    __u64 child_cycles;
+    __u64 cycles;
+    __u64 event[PMU_MAX_EVENTS];
+};
+
+/*
+ * Everything one thread measured. Only its thread writes it; tables are
+ * never freed and are pushed onto a lock-free list, so pmu_region_dump()
+ * can merge them after the threads are gone.
+ */
+struct table {
+    struct table *next;
+    pid_t tid;
+    int local;              /* counts come from ctx, not from snapshots */
+    struct pmu_thread ctx;
+    __u64 max_staleness_ns;
+    unsigned int depth;
+    struct frame stack[PMU_REGION_MAX_DEPTH];
+    struct region regions[PMU_REGION_MAX];
+};
+
+static struct pmu *pmu;
+static struct pmu_event_config config;
+static int started;         /* we started the counters, stop them at exit */
+static int use_local;       /* module backend: per-thread local snapshots */
+static int init_errno;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static struct table *tables;
+static __thread struct table *self;
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void region_exit(void)
+{
+    const char *path = getenv("PMU_REGION_OUT");
+    FILE *out = stderr;
+
+    if (path) {
+        out = fopen(path, "w");
+        if (!out) {
+            perror(path);
+            out = stderr;
+        }
+    }
+    pmu_region_dump(out);
+    if (out != stderr)
+        fclose(out);
+
+    if (started)
+        pmu_stop(pmu, NULL);
+    pmu_close(pmu);
+}
+
+static void region_init(void)
+{
+    struct pmu_snapshot snap;
+
+    pmu = pmu_open();
+    if (!pmu || pmu_snapshot(pmu, &snap) < 0)
+        goto fail;
+
+    if (!snap.state) {
+        if (pmu_start(pmu) < 0)
+            goto fail;
+        started = 1;
+    }
+    config = snap.config;
+    use_local = !strcmp(pmu_backend_name(pmu), "module");
+    atexit(region_exit);
+    return;
+
+fail:
+    init_errno = errno;
+    fprintf(stderr, "pmu_region: no counters (%s), regions are not measured\n",
+            strerror(errno));
+    pmu_close(pmu);
+    pmu = NULL;
+}
+
+static struct table *table_get(void)
+{
+    struct table *t = self;
+
+    if (t)
+        return t;
+
+    t = calloc(1, sizeof(*t));
+    if (!t)
+        return NULL;
+    t->tid = syscall(SYS_gettid);
+    t->local = use_local && pmu_thread_init(pmu, &t->ctx) == 0;
+
+    t->next = __atomic_load_n(&tables, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&tables, &t->next, t, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    self = t;
+    return t;
+}
+
+/*
+ * The thread's counts so far, or the whole target's without the module.
+ * Local and perf counts are read live (staleness 0); a module snapshot is
+ * what the cpus last published, up to publish_ms old.
+ */
+static int region_read(struct table *t, struct pmu_counts *counts,
+                       __u64 *staleness_ns)
+{
+    struct pmu_snapshot snap;
+
+    *staleness_ns = 0;
+    if (t->local)
+        return pmu_thread_read(pmu, &t->ctx, counts);
+
+    if (pmu_snapshot(pmu, &snap) < 0)
+        return -1;
+    *counts = snap.total;
+    *staleness_ns = snap.staleness_ns;
+    if (snap.staleness_ns > t->max_staleness_ns)
+        t->max_staleness_ns = snap.staleness_ns;
+    return 0;
+}
+
+/* FNV-1a open addressing in a PMU_REGION_MAX table */
+static struct region *region_lookup(struct region *tab, const char *name)
+{
+    unsigned int h = 2166136261U;
+    unsigned int i, slot;
+    const char *p;
+
+    for (p = name; *p; p++)
+        h = (h ^ (unsigned char)*p) * 16777619U;
+
+    for (i = 0; i < PMU_REGION_MAX; i++) {
+        slot = (h + i) % PMU_REGION_MAX;
+        if (!tab[slot].name) {
+            tab[slot].name = strdup(name);
+            if (!tab[slot].name)
+                return NULL;
+            tab[slot].min_cycles = ~0ULL;
+            return &tab[slot];
+        }
+        if (!strcmp(tab[slot].name, name))
+            return &tab[slot];
+    }
+    errno = ENOSPC;
+    return NULL;
+}
+
+int pmu_region_begin(const char *name)
+{
+    struct pmu_counts counts;
+    struct table *t;
+    struct frame *f;
+    struct region *r;
+
+    pthread_once(&init_once, region_init);
+    if (!pmu) {
+        errno = init_errno;
+        return -1;
+    }
+    t = table_get();
+    if (!t)
+        return -1;
+    if (t->depth == PMU_REGION_MAX_DEPTH) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    r = region_lookup(t->regions, name);
+    if (!r)
+        return -1;
+
+    f = &t->stack[t->depth];
+    f->region = r;
+    f->child_cycles = 0;
+
+    /* the read goes last so our own bookkeeping is not counted */
+    f->wall_ns = now_ns();
+    if (region_read(t, &counts, &f->staleness_ns) < 0)
+        return -1;
+    f->rebases = t->ctx.rebases;
+    f->cycles = counts.cycles;
+    memcpy(f->event, counts.event, config.nr_events * sizeof(__u64));
+    t->depth++;
+    return 0;
+}
+
+int pmu_region_end(const char *name)
+{
+    struct pmu_counts counts;
+    struct table *t = self;
+    struct region *r;
+    struct frame *f;
+    __u64 cycles, wall_ns, staleness_ns;
+    unsigned int i;
+
+    if (!pmu || !t) {
+        errno = pmu ? EINVAL : init_errno;
+        return -1;
+    }
+    if (region_read(t, &counts, &staleness_ns) < 0)
+        return -1;
+    wall_ns = now_ns();
+
+    if (!t->depth || strcmp(t->stack[t->depth - 1].region->name, name)) {
+        errno = EINVAL;
+        return -1;
+    }
+    f = &t->stack[--t->depth];
+    r = f->region;
+
+    /*
+     * A rebase by this read or by any nested region's read lost part of
+     * the region, so its counts would be short (down to 0).
+     */
+    if (counts.cycles < f->cycles || t->ctx.rebases != f->rebases) {
+        r->dropped++;
+        return 0;
+    }
+    /*
+     * Either snapshot may predate the region by its staleness. A region
+     * shorter than that could be charged counts from before it or none
+     * at all, so it is only counted as stale.
+     */
+    if (staleness_ns < f->staleness_ns)
+        staleness_ns = f->staleness_ns;
+    if (wall_ns - f->wall_ns < staleness_ns) {
+        r->stale++;
+        return 0;
+    }
+
+    cycles = counts.cycles - f->cycles;
+    r->calls++;
+    r->cycles += cycles;
+    r->self_cycles += cycles > f->child_cycles ? cycles - f->child_cycles : 0;
+    if (cycles < r->min_cycles)
+        r->min_cycles = cycles;
+    if (cycles > r->max_cycles)
+        r->max_cycles = cycles;
+    r->wall_ns += wall_ns - f->wall_ns;
+    for (i = 0; i < config.nr_events; i++) {
+        if (counts.event[i] > f->event[i])
+            r->event[i] += counts.event[i] - f->event[i];
+    }
+
+    if (t->depth)
+        t->stack[t->depth - 1].child_cycles += cycles;
+    return 0;
+}
+
+static void region_merge(struct region *dst, const struct region *src)
+{
+    unsigned int i;
+
+    dst->calls += src->calls;
+    dst->dropped += src->dropped;
+    dst->stale += src->stale;
+    dst->cycles += src->cycles;
+    dst->self_cycles += src->self_cycles;
+    if (src->calls && src->min_cycles < dst->min_cycles)
+        dst->min_cycles = src->min_cycles;
+    if (src->max_cycles > dst->max_cycles)
+        dst->max_cycles = src->max_cycles;
+    dst->wall_ns += src->wall_ns;
+    for (i = 0; i < PMU_MAX_EVENTS; i++)
+        dst->event[i] += src->event[i];
+}
+
+static int cmp_cycles(const void *a, const void *b)
+{
+    const struct region *x = *(struct region *const *)a;
+    const struct region *y = *(struct region *const *)b;
+
+    if (x->cycles != y->cycles)
+        return x->cycles < y->cycles ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+static void print_header(FILE *out)
+{
+    const char *name;
+    unsigned int k;
+
+    fprintf(out, "%-24s %10s %14s %14s %12s %12s %12s",
+            "region", "calls", "cycles", "self_cycles", "min", "max", "wall_ms");
+    for (k = 0; k < config.nr_events; k++) {
+        name = pmu_event_name(config.event[k]);
+        if (name)
+            fprintf(out, " %14s", name);
+        else
+            fprintf(out, "     event_0x%02x", config.event[k]);
+    }
+    fprintf(out, "\n");
+}
+
+/*
+ * rows sorted by cycles, label is "name" or "name[tid]"; events whose bit
+ * is set in missing were never counted and print as n/a
+ */
+static void print_rows(FILE *out, struct region *tab, pid_t tid, __u32 missing)
+{
+    struct region *sorted[PMU_REGION_MAX];
+    const struct region *r;
+    char label[64];
+    unsigned int i, k, n = 0;
+
+    for (i = 0; i < PMU_REGION_MAX; i++) {
+        if (tab[i].name)
+            sorted[n++] = &tab[i];
+    }
+    qsort(sorted, n, sizeof(sorted[0]), cmp_cycles);
+
+    for (i = 0; i < n; i++) {
+        r = sorted[i];
+        if (tid)
+            snprintf(label, sizeof(label), "%s[%d]", r->name, (int)tid);
+        else
+            snprintf(label, sizeof(label), "%s", r->name);
+
+        fprintf(out, "%-24s %10llu %14llu %14llu %12llu %12llu %12.3f",
+                label, r->calls, r->cycles, r->self_cycles,
+                r->calls ? r->min_cycles : 0, r->max_cycles, r->wall_ns / 1e6);
+        for (k = 0; k < config.nr_events; k++) {
+            if (missing & (1U << k))
+                fprintf(out, " %14s", "n/a");
+            else
+                fprintf(out, " %14llu", r->event[k]);
+        }
+        if (r->dropped)
+            fprintf(out, "  (%llu calls dropped, counters reset or thread rebased)",
+                    r->dropped);
+        if (r->stale)
+            fprintf(out, "  (%llu calls shorter than the snapshot age, not counted)",
+                    r->stale);
+        fprintf(out, "\n");
+    }
+}
+
+/* meant for after the threads are done; running ones may be caught mid-update */
+void pmu_region_dump(FILE *out)
+{
+    struct table *head = __atomic_load_n(&tables, __ATOMIC_ACQUIRE);
+    struct region *combined, *r;
+    struct table *t;
+    struct pmu_snapshot snap;
+    __u64 staleness_ns = 0, rebases = 0;
+    __u32 missing = 0;
+    unsigned int i, nr_threads = 0;
+
+    combined = calloc(PMU_REGION_MAX, sizeof(*combined));
+    if (!combined)
+        return;
+
+    for (t = head; t; t = t->next) {
+        nr_threads++;
+        rebases += t->ctx.rebases;
+        if (t->max_staleness_ns > staleness_ns)
+            staleness_ns = t->max_staleness_ns;
+        for (i = 0; i < PMU_REGION_MAX; i++) {
+            if (!t->regions[i].name)
+                continue;
+            r = region_lookup(combined, t->regions[i].name);
+            if (r)
+                region_merge(r, &t->regions[i]);
+        }
+    }
+
+    if (use_local)
+        fprintf(out, "==== PMU regions (%u threads, per-thread counts, %llu rebases) ====\n",
+                nr_threads, rebases);
+    else
+        fprintf(out, "==== PMU regions (%s backend, counts up to %.1f ms old) ====\n",
+                pmu ? pmu_backend_name(pmu) : "no", staleness_ns / 1e6);
+    if (pmu && pmu_snapshot(pmu, &snap) == 0) {
+        for (i = 0; i < config.nr_events; i++) {
+            if (!pmu_counted(&snap.total, i))
+                missing |= 1U << i;
+        }
+    }
+    print_header(out);
+    print_rows(out, combined, 0, missing);
+
+    if (nr_threads > 1) {
+        fprintf(out, "---- per thread ----\n");
+        for (t = head; t; t = t->next)
+            print_rows(out, t->regions, t->tid, missing);
+    }
+
+    for (i = 0; i < PMU_REGION_MAX; i++)
+        free(combined[i].name);
+    free(combined);
+}
@@ -0,0 +1,60 @@
+#ifndef PMU_REGION_H
+#define PMU_REGION_H
+
+#include <stdio.h>
+
+/*
+ * Named measurement regions on top of libpmu.
+ *
+ *     PMU_REGION_BEGIN("mm_inner");
+ *     ... work, may contain other regions ...
+ *     PMU_REGION_END("mm_inner");
+ *
+ * The counters are never reset: begin and end each take a snapshot and the
+ * region is charged the difference. So regions nest, repeat and can be
+ * spread over a program without a global start/stop. Every thread has
+ * its own region stack and its own totals per name: calls, cycles, self
+ * cycles (without nested regions), min/max cycles per call, wall time and
+ * every configured event. At exit the totals are merged and printed, once
+ * combined and once per thread, to stderr or to the file named by
+ * PMU_REGION_OUT.
+ *
+ * The first region opens libpmu. If the counters are not running, it
+ * starts them. If they are running (under pmu_run, for example), it uses
+ * them as they are. With the module, every thread reads its own counts
+ * (struct pmu_thread), carried across switches and migrations, so a region
+ * only counts its thread. A call during which the thread was rebased lost
+ * counts and is dropped. With the perf backend, regions
+ * difference whole-process snapshots. perf only adds a thread's counts to
+ * the process when that thread exits, so there they only work in the
+ * main thread. Whole-machine module snapshots can be up to publish_ms
+ * old; a region shorter than the age of its snapshots is not charged and
+ * is reported as stale instead.
+ *
+ * Link with src/pmu_region.c src/libpmu.c -lpthread. With
+ * -DPMU_REGION_DISABLE the macros compile to nothing.
+ */
+
+#define PMU_REGION_MAX_DEPTH 32
+#define PMU_REGION_MAX       256
+
+#ifdef PMU_REGION_DISABLE
+#define PMU_REGION_BEGIN(name) ((void)0)
+#define PMU_REGION_END(name)   ((void)0)
+#else
+#define PMU_REGION_BEGIN(name) pmu_region_begin(name)
+#define PMU_REGION_END(name)   pmu_region_end(name)
+#endif
+
+/*
+ * 0 on success, -1 with errno set: the pmu could not be opened, the stack
+ * is full (EOVERFLOW), the region table is full (ENOSPC) or name is not
+ * the innermost open region (EINVAL, the stack is left as it was).
+ */
+int pmu_region_begin(const char *name);
+int pmu_region_end(const char *name);
+
+/* print the totals now; also done once at exit */
+void pmu_region_dump(FILE *out);
+
+#endif /* PMU_REGION_H */
@@ -0,0 +1,383 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "libpmu.h"
+
+/*
+ * Runs a workload under the pmu module and writes one row per workload.
+ *
+ *   pmu_run [-n name] [-r N] [-f csv|json] [-o file] [-a] -- cmd args...
+ *
+ * Every run forks the command, which waits until the counters were reset
+ * and started, then execs. When it exits the counters are stopped and
+ * read in one ioctl. By default only the command and its children are
+ * counted; -a counts the whole machine like measure.sh used to.
+ *
+ * CSV columns are the mean over the runs, followed by <col>_stddev and
+ * <col>_min. With -o the row is appended and the header only written
+ * into an empty file, so several workloads can share one results.csv.
+ */
+
+#define MAX_COLS (PMU_MAX_EVENTS + 2)
+
+struct column {
+    char name[32];
+    double *val;        /* one per run */
+    double mean, stddev, min;
+};
+
+static struct column cols[MAX_COLS];
+static unsigned int nr_cols;
+
+/* names of the default six in results.csv, as part2.py reads them */
+static const struct pmu_event_desc csv_names[] = {
+    { EVT_INSTR_RETIRED, "instructions" },
+    { EVT_L1I_ACCESS,    "l1i_ref" },
+    { EVT_L1I_REFILL,    "l1i_miss" },
+    { EVT_L1D_ACCESS,    "l1d_ref" },
+    { EVT_L1D_REFILL,    "l1d_miss" },
+    { EVT_LLC_REFILL,    "llc_miss" },
+};
+
+static void column_name(char *buf, size_t len, __u32 event)
+{
+    const char *name = NULL;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(csv_names) / sizeof(csv_names[0]); i++) {
+        if (csv_names[i].code == event)
+            name = csv_names[i].name;
+    }
+    if (!name)
+        name = pmu_event_name(event);
+
+    if (name)
+        snprintf(buf, len, "%s", name);
+    else
+        snprintf(buf, len, "event_0x%02x", event);
+}
+
+/* events first and cycles after them, the order measure.sh always wrote */
+static int setup_columns(const struct pmu_event_config *config, int repeat)
+{
+    unsigned int i;
+
+    nr_cols = config->nr_events + 2;
+    for (i = 0; i < nr_cols; i++) {
+        if (i < config->nr_events)
+            column_name(cols[i].name, sizeof(cols[i].name), config->event[i]);
+        else if (i == config->nr_events)
+            strcpy(cols[i].name, "cycles");
+        else
+            strcpy(cols[i].name, "wall_ns");
+
+        cols[i].val = calloc(repeat, sizeof(double));
+        if (!cols[i].val)
+            return -1;
+    }
+    return 0;
+}
+
+static void record_run(const struct pmu_snapshot *snap, double wall_ns, int run)
+{
+    unsigned int i;
+
+    /* NAN for an event perf could not count here */
+    for (i = 0; i < snap->config.nr_events; i++)
+        cols[i].val[run] = pmu_counted(&snap->total, i) ?
+                           (double)snap->total.event[i] : NAN;
+    cols[i++].val[run] = snap->total.cycles;
+    cols[i].val[run] = wall_ns;
+}
+
+static void summarize(int runs)
+{
+    struct column *c;
+    double sum, sq;
+    unsigned int i;
+    int r;
+
+    for (i = 0; i < nr_cols; i++) {
+        c = &cols[i];
+        sum = 0;
+        c->min = c->val[0];
+        for (r = 0; r < runs; r++) {
+            sum += c->val[r];
+            if (c->val[r] < c->min)
+                c->min = c->val[r];
+        }
+        c->mean = sum / runs;
+
+        sq = 0;
+        for (r = 0; r < runs; r++)
+            sq += (c->val[r] - c->mean) * (c->val[r] - c->mean);
+        if (runs > 1)
+            c->stddev = sqrt(sq / (runs - 1));
+        else
+            c->stddev = isnan(c->mean) ? NAN : 0;
+    }
+}
+
+/* val with fmt, or none if the column has no counts (NAN) */
+static void put_value(FILE *out, const char *fmt, double val, const char *none)
+{
+    if (isnan(val))
+        fprintf(out, "%s", none);
+    else
+        fprintf(out, fmt, val);
+}
+
+static void write_csv(FILE *out, const char *name, int runs, int header)
+{
+    unsigned int i;
+
+    if (header) {
+        fprintf(out, "workload");
+        for (i = 0; i < nr_cols; i++)
+            fprintf(out, ",%s", cols[i].name);
+        fprintf(out, ",runs");
+        for (i = 0; i < nr_cols; i++)
+            fprintf(out, ",%s_stddev", cols[i].name);
+        for (i = 0; i < nr_cols; i++)
+            fprintf(out, ",%s_min", cols[i].name);
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "%s", name);
+    for (i = 0; i < nr_cols; i++)
+        put_value(out, ",%.0f", cols[i].mean, ",");
+    fprintf(out, ",%d", runs);
+    for (i = 0; i < nr_cols; i++)
+        put_value(out, ",%.1f", cols[i].stddev, ",");
+    for (i = 0; i < nr_cols; i++)
+        put_value(out, ",%.0f", cols[i].min, ",");
+    fprintf(out, "\n");
+}
+
+/* s as a JSON string, with quotes, backslashes and control bytes escaped */
+static void put_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+/* "name": with the separator before it */
+static void put_json_key(FILE *out, unsigned int i, const char *name)
+{
+    fprintf(out, "%s", i ? "," : "");
+    put_json_string(out, name);
+    fputc(':', out);
+}
+
+/* one JSON object per line */
+static void write_json(FILE *out, const char *name, int runs)
+{
+    unsigned int i;
+    int r;
+
+    fprintf(out, "{\"workload\":");
+    put_json_string(out, name);
+    fprintf(out, ",\"runs\":[");
+    for (r = 0; r < runs; r++) {
+        fprintf(out, "%s{", r ? "," : "");
+        for (i = 0; i < nr_cols; i++) {
+            put_json_key(out, i, cols[i].name);
+            put_value(out, "%.0f", cols[i].val[r], "null");
+        }
+        fprintf(out, "}");
+    }
+
+    fprintf(out, "],\"mean\":{");
+    for (i = 0; i < nr_cols; i++) {
+        put_json_key(out, i, cols[i].name);
+        put_value(out, "%.1f", cols[i].mean, "null");
+    }
+    fprintf(out, "},\"stddev\":{");
+    for (i = 0; i < nr_cols; i++) {
+        put_json_key(out, i, cols[i].name);
+        put_value(out, "%.1f", cols[i].stddev, "null");
+    }
+    fprintf(out, "},\"min\":{");
+    for (i = 0; i < nr_cols; i++) {
+        put_json_key(out, i, cols[i].name);
+        put_value(out, "%.0f", cols[i].min, "null");
+    }
+    fprintf(out, "}}\n");
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* fork, count, exec, wait, read; returns the child's wait status or -1 */
+static int run_once(struct pmu *pmu, char **argv, int system_wide,
+                    struct pmu_snapshot *snap, double *wall_ns)
+{
+    int go[2], status = -1;
+    double start;
+    pid_t child;
+    char c;
+
+    if (pipe(go) < 0)
+        return -1;
+
+    child = fork();
+    if (child < 0) {
+        close(go[0]);
+        close(go[1]);
+        return -1;
+    }
+    if (!child) {
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1)
+            _exit(127);
+        close(go[0]);
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(go[0]);
+
+    if (!system_wide && pmu_set_target(pmu, child, PMU_TARGET_CHILDREN) < 0)
+        goto kill;
+
+    start = now_ns();
+    if (pmu_start(pmu) < 0)
+        goto kill;
+    if (write(go[1], "g", 1) != 1)
+        goto kill;
+    close(go[1]);
+
+    if (waitpid(child, &status, 0) < 0)
+        return -1;
+    *wall_ns = now_ns() - start;
+    if (pmu_stop(pmu, snap) < 0)
+        return -1;
+    return status;
+
+kill:
+    close(go[1]);
+    waitpid(child, NULL, 0);
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n name] [-r N] [-f csv|json] [-o file] [-a] -- cmd args...\n"
+            "  -n, --name     workload name (default: the command)\n"
+            "  -r, --repeat   run N times, report mean, stddev and min\n"
+            "  -f, --format   csv (default) or json\n"
+            "  -o, --output   append to file instead of stdout\n"
+            "  -a, --all      count every cpu, not only the command\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option opts[] = {
+        { "name",   required_argument, NULL, 'n' },
+        { "repeat", required_argument, NULL, 'r' },
+        { "format", required_argument, NULL, 'f' },
+        { "output", required_argument, NULL, 'o' },
+        { "all",    no_argument,       NULL, 'a' },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    struct pmu_snapshot snap;
+    struct stat sb;
+    struct pmu *pmu;
+    const char *name = NULL, *path = NULL, *format = "csv";
+    FILE *out = stdout;
+    double wall_ns;
+    int repeat = 1, system_wide = 0, header = 1;
+    int opt, run, status, ret = 1;
+
+    while ((opt = getopt_long(argc, argv, "+n:r:f:o:ah", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'n': name = optarg; break;
+        case 'r': repeat = atoi(optarg); break;
+        case 'f': format = optarg; break;
+        case 'o': path = optarg; break;
+        case 'a': system_wide = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || repeat < 1 ||
+        (strcmp(format, "csv") && strcmp(format, "json")))
+        usage(argv[0]);
+    if (!name)
+        name = argv[optind];
+
+    pmu = pmu_open();
+    if (!pmu) {
+        perror("pmu_open");
+        return 1;
+    }
+
+    for (run = 0; run < repeat; run++) {
+        status = run_once(pmu, &argv[optind], system_wide, &snap, &wall_ns);
+        if (status < 0) {
+            perror("pmu_run");
+            goto out;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            fprintf(stderr, "pmu_run: %s run %d exited with status %d\n",
+                    name, run, status);
+
+        if (!run && setup_columns(&snap.config, repeat) < 0) {
+            perror("calloc");
+            goto out;
+        }
+        record_run(&snap, wall_ns, run);
+    }
+    summarize(repeat);
+
+    if (path) {
+        out = fopen(path, "a");
+        if (!out) {
+            perror(path);
+            goto out;
+        }
+        header = fstat(fileno(out), &sb) == 0 && sb.st_size == 0;
+    }
+
+    if (!strcmp(format, "json"))
+        write_json(out, name, repeat);
+    else
+        write_csv(out, name, repeat, header);
+
+    if (out != stdout)
+        fclose(out);
+    ret = 0;
+
+out:
+    if (!system_wide)
+        pmu_set_target(pmu, 0, 0);
+    pmu_close(pmu);
+    return ret;
+}
@@ -0,0 +1,317 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pmu_events.h"
+#include "pmu_ioctl.h"
+
+/*
+ * Runs part3's counter core (pmu_counters.h) against the sim backend
+ * (pmu_backend.h) in userspace and checks the counts it gets:
+ *
+ *   gcc -O2 -Wall ./src/pmu_sim_test.c -o ./bin/pmu_sim_test && ./bin/pmu_sim_test
+ *
+ * The sim only advances on counter reads and time comes from test_now,
+ * so every expected value below is exact. Exits 1 on the first mismatch.
+ */
+
+/* the kernel names the two headers use */
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define BIT(n)          (1UL << (n))
+#define BIT_ULL(n)      (1ULL << (n))
+#define GENMASK(h, l)   (((~0UL) >> (63 - (h))) & (~0UL << (l)))
+#define U32_MAX         0xffffffffU
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define min(a, b)       ((a) < (b) ? (a) : (b))
+#define min_t(t, a, b)  ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b)  ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define for_each_set_bit(bit, addr, size) \
+    for ((bit) = 0; (bit) < (size); (bit)++) \
+        if (*(addr) & (1UL << (bit)))
+#define DEFINE_PER_CPU(type, name) type name
+#define this_cpu_ptr(ptr)       (ptr)
+#define local_irq_save(flags)   ((flags) = 0)
+#define local_irq_restore(flags) ((void)(flags))
+
+static u64 test_now;
+
+static u64 ktime_get_ns(void)
+{
+    return test_now;
+}
+
+static u64 mul_u64_u64_div_u64(u64 a, u64 b, u64 c)
+{
+    return (u64)((unsigned __int128)a * b / c);
+}
+
+/* what part3.c defines before including pmu_counters.h */
+#define EVENT_COUNTERS_ALL GENMASK(30, 0)
+#define PMU_ENABLE_BIT    BIT(0)
+#define PMU_RESET_EVENTS  BIT(1)
+#define PMU_RESET_CYCLES  BIT(2)
+#define PMU_LONG_CYCLES   BIT(6)
+#define PMU_CYCLE_COUNTER BIT(31)
+
+struct pmu_cpu_state {
+    u64 overflow[PMU_MAX_EVENTS];
+    u64 accum[PMU_MAX_EVENTS];
+    u64 time_running[PMU_MAX_EVENTS];
+    u64 time_enabled;
+    u64 enabled_since;
+    u64 group_since;
+    u32 group;
+    bool active;
+    u64 epoch;
+};
+
+static DEFINE_PER_CPU(struct pmu_cpu_state, pmu_cpu_state);
+static const struct pmu_backend_ops *pmu_ops;
+static struct pmu_event_config pmu_config;
+static u32 pmu_nr_counters;
+static bool pmu_irq_enabled;
+static u32 pmu_sample_event;
+static u32 pmu_sample_period;
+static u32 pmu_sample_counter;
+static u32 pmu_sample_mask;
+
+#include "pmu_backend.h"
+#include "pmu_counters.h"
+
+#define MS 1000000ULL
+
+/* sim advances seen by each counter while it was enabled */
+static u64 advances[SIM_NR_COUNTERS];
+
+static void count_advance(void)
+{
+    struct pmu_sim_cpu *sim = this_cpu_ptr(&pmu_sim_cpu);
+    u32 i;
+
+    if (!(sim->pmcr & SIM_PMCR_E))
+        return;
+    for (i = 0; i < SIM_NR_COUNTERS; i++) {
+        if (sim->cnten & BIT(i))
+            advances[i]++;
+    }
+}
+
+static const struct pmu_backend_ops *sim_ops;
+
+static u64 counting_read_pmxevcntr_el0(void)
+{
+    if (this_cpu_ptr(&pmu_sim_cpu)->sel < SIM_NR_COUNTERS)
+        count_advance();
+    return sim_ops->read_pmxevcntr_el0();
+}
+
+static u64 counting_read_pmccntr_el0(void)
+{
+    count_advance();
+    return sim_ops->read_pmccntr_el0();
+}
+
+static struct pmu_backend_ops counting_ops;
+
+static int failed;
+
+#define CHECK(cond, fmt, ...) do { \
+    if (!(cond)) { \
+        printf("FAIL %s:%d: " fmt "\n", __func__, __LINE__, ##__VA_ARGS__); \
+        failed = 1; \
+        return; \
+    } \
+} while (0)
+
+static void setup(u32 step, const u32 *events, u32 nr)
+{
+    memset(&pmu_sim_cpu, 0, sizeof(pmu_sim_cpu));
+    memset(&pmu_cpu_state, 0, sizeof(pmu_cpu_state));
+    memset(advances, 0, sizeof(advances));
+    pmu_sim_step = step;
+    pmu_config.nr_events = nr;
+    memcpy(pmu_config.event, events, nr * sizeof(events[0]));
+    test_now = 0;
+}
+
+/* PMCR.E/P/C/LC, PMCNTEN and the overflow flags of the model */
+static void test_state_machine(void)
+{
+    struct pmu_sim_cpu *sim = this_cpu_ptr(&pmu_sim_cpu);
+    static const u32 none[1];
+
+    setup(1600, none, 0);
+    CHECK(((read_pmcr_el0() >> 11) & 0x1f) == SIM_NR_COUNTERS,
+          "PMCR.N is %llu", (unsigned long long)(read_pmcr_el0() >> 11) & 0x1f);
+
+    pmu_program_counter(0, EVT_INSTR_RETIRED);
+    pmu_program_counter(1, EVT_L1D_ACCESS);
+    write_pmcntenset_el0(BIT(0) | BIT(1) | PMU_CYCLE_COUNTER);
+    CHECK(read_event_counter(0) == 0, "counted with PMCR.E clear");
+
+    write_pmcr_el0(PMU_ENABLE_BIT | PMU_LONG_CYCLES);
+    CHECK(read_event_counter(0) == 1600, "instructions %llu after one read",
+          (unsigned long long)sim->evcntr[0]);
+    CHECK(read_event_counter(1) == 2 * 600, "l1d %llu after two reads",
+          (unsigned long long)sim->evcntr[1]);
+    CHECK(read_pmccntr_el0() == 3 * 1600, "cycles %llu after three reads",
+          (unsigned long long)sim->ccntr);
+
+    write_pmcntenclr_el0(BIT(1));
+    read_event_counter(0);
+    CHECK(read_event_counter(1) == 3 * 600, "disabled counter moved");
+
+    write_pmcr_el0(PMU_ENABLE_BIT | PMU_LONG_CYCLES | PMU_RESET_EVENTS);
+    CHECK(sim->evcntr[0] == 0 && sim->evcntr[1] == 0 && sim->ccntr != 0,
+          "PMCR.P reset the wrong counters");
+    write_pmcr_el0(PMU_ENABLE_BIT | PMU_LONG_CYCLES | PMU_RESET_CYCLES);
+    CHECK(sim->ccntr == 0, "PMCR.C left cycles at %llu",
+          (unsigned long long)sim->ccntr);
+
+    /* PMCR.LC: 64-bit cycles; without it they wrap at 32 bits too */
+    sim->ccntr = U32_MAX;
+    read_pmccntr_el0();
+    CHECK(sim->ccntr == U32_MAX + 1600ULL && !(read_pmovsclr_el0() & PMU_CYCLE_COUNTER),
+          "64-bit cycle counter wrapped (%llu)", (unsigned long long)sim->ccntr);
+    write_pmcr_el0(PMU_ENABLE_BIT);
+    sim->ccntr = U32_MAX;
+    read_pmccntr_el0();
+    CHECK(sim->ccntr == 1599 && (read_pmovsclr_el0() & PMU_CYCLE_COUNTER),
+          "32-bit cycle counter did not wrap (%llu)", (unsigned long long)sim->ccntr);
+
+    sim->evcntr[0] = U32_MAX - 100;
+    read_event_counter(0);
+    CHECK(sim->evcntr[0] == 1499 && (read_pmovsclr_el0() & BIT(0)),
+          "event counter did not wrap (%u)", sim->evcntr[0]);
+    write_pmovsclr_el0(BIT(0));
+    CHECK(!(read_pmovsclr_el0() & BIT(0)), "PMOVSCLR did not clear");
+
+    printf("ok   state machine\n");
+}
+
+/* 2^28 per read wraps the 32-bit counters every 16 reads */
+static void test_overflow_folding(void)
+{
+    static const u32 events[] = {
+        EVT_INSTR_RETIRED, EVT_L1D_ACCESS, EVT_L1D_REFILL,
+        EVT_L1I_ACCESS, EVT_CPU_CYCLES, EVT_BR_MIS_PRED,
+    };
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    const u64 step = 1ULL << 28;
+    struct pmu_counts c;
+    u32 i;
+    int r;
+
+    setup(step, events, 6);
+    pmu_reset_cpu(NULL);
+    CHECK(st->active && st->group == 0, "not counting after reset");
+
+    for (r = 0; r < 100; r++)
+        pmu_read_local(&c);
+    /* the stop path folds the live group into accum */
+    test_now = 5 * MS;
+    pmu_disable_cpu(NULL);
+    CHECK(!st->active && st->time_enabled == 5 * MS, "still counting after disable");
+    pmu_read_local(&c);
+
+    CHECK(c.event[0] > 16 * (1ULL << 32), "only %llu instructions, nothing wrapped",
+          (unsigned long long)c.event[0]);
+    for (i = 0; i < 6; i++) {
+        u64 want = advances[i] * (step * pmu_sim_rate(events[i]) / 16);
+
+        CHECK(c.event[i] == want, "event %u: %llu, want %llu", i,
+              (unsigned long long)c.event[i], (unsigned long long)want);
+    }
+    CHECK(c.event[0] == c.event[4], "instructions %llu != cpu_cycles event %llu",
+          (unsigned long long)c.event[0], (unsigned long long)c.event[4]);
+
+    printf("ok   32->64-bit folding (%llu instructions)\n",
+           (unsigned long long)c.event[0]);
+}
+
+/* 8 events on 6 counters: group 0 runs for 4 ms, then group 1 for 6 ms */
+static void test_multiplex_scaling(void)
+{
+    static const u32 events[] = {
+        EVT_INSTR_RETIRED, EVT_L1D_ACCESS, EVT_L1D_REFILL,
+        EVT_L1I_ACCESS, EVT_CPU_CYCLES, EVT_BR_MIS_PRED,
+        EVT_INSTR_RETIRED, EVT_L1D_ACCESS,
+    };
+    struct pmu_cpu_state *st = this_cpu_ptr(&pmu_cpu_state);
+    const u64 step = 1600;
+    u64 group0, group1;
+    struct pmu_counts c, scaled;
+    u32 i;
+    int r;
+
+    setup(step, events, 8);
+    CHECK(pmu_nr_groups() == 2 && pmu_group_size(1) == 2, "%u groups",
+          pmu_nr_groups());
+
+    pmu_reset_cpu(NULL);
+    for (r = 0; r < 10; r++)
+        pmu_read_local(&c);
+    test_now = 4 * MS;
+    pmu_rotate(st, test_now);
+    group0 = advances[0];
+    CHECK(st->group == 1, "rotated to group %u", st->group);
+
+    for (r = 0; r < 10; r++)
+        pmu_read_local(&c);
+    test_now = 10 * MS;
+    pmu_disable_cpu(NULL);
+    pmu_read_local(&c);
+    group1 = advances[0] - group0;
+
+    CHECK(c.time_enabled == 10 * MS, "enabled %llu ns",
+          (unsigned long long)c.time_enabled);
+    for (i = 0; i < 6; i++)
+        CHECK(c.time_running[i] == 4 * MS, "event %u ran %llu ns", i,
+              (unsigned long long)c.time_running[i]);
+    for (i = 6; i < 8; i++)
+        CHECK(c.time_running[i] == 6 * MS, "event %u ran %llu ns", i,
+              (unsigned long long)c.time_running[i]);
+    CHECK(c.event[0] == group0 * step && c.event[6] == group1 * step,
+          "raw instructions %llu/%llu, want %llu/%llu",
+          (unsigned long long)c.event[0], (unsigned long long)c.event[6],
+          (unsigned long long)(group0 * step), (unsigned long long)(group1 * step));
+
+    scaled = c;
+    scaled.time_running[7] = 0;
+    pmu_scale_counts(&scaled, 8);
+    CHECK(scaled.event[0] == c.event[0] * 10 / 4, "group 0 scaled to %llu",
+          (unsigned long long)scaled.event[0]);
+    CHECK(scaled.event[6] == c.event[6] * 10 / 6, "group 1 scaled to %llu",
+          (unsigned long long)scaled.event[6]);
+    CHECK(scaled.event[7] == 0, "never-run event scaled to %llu",
+          (unsigned long long)scaled.event[7]);
+
+    /* a group that ran the whole time is left as it is */
+    scaled = c;
+    scaled.time_running[0] = scaled.time_enabled;
+    pmu_scale_counts(&scaled, 1);
+    CHECK(scaled.event[0] == c.event[0], "unmultiplexed event scaled");
+
+    printf("ok   multiplex scaling (%llu -> %llu instructions in group 0)\n",
+           (unsigned long long)c.event[0], (unsigned long long)c.event[0] * 10 / 4);
+}
+
+int main(void)
+{
+    sim_ops = pmu_backend_find("sim");
+    counting_ops = *sim_ops;
+    counting_ops.read_pmxevcntr_el0 = counting_read_pmxevcntr_el0;
+    counting_ops.read_pmccntr_el0 = counting_read_pmccntr_el0;
+    pmu_ops = &counting_ops;
+    pmu_nr_counters = SIM_NR_COUNTERS;
+
+    test_state_machine();
+    if (!failed)
+        test_overflow_folding();
+    if (!failed)
+        test_multiplex_scaling();
+    return failed;
+}
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpmu.h"
+
+/*
+ * Per-cpu counter timeline as CSV on stdout.
+ *
+ *   pmu_stream [-i us] [-d seconds]
+ *
+ * One row per cpu and interval: end time, cpu, length, cycles, every
+ * configured event (scaled when multiplexed) and IPC if instructions are
+ * counted. Runs until -d expires or it gets SIGINT, e.g.
+ *   ./bin/pmu_stream -i 1000 > timeline.csv & ./bin/matrix_phases; kill %1
+ */
+
+#define BATCH 64
+
+static volatile sig_atomic_t done;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    done = 1;
+}
+
+static __u64 scaled(const struct pmu_counts *c, unsigned int i)
+{
+    if (!c->time_running[i])
+        return 0;
+    if (c->time_running[i] >= c->time_enabled)
+        return c->event[i];
+    return (__u64)((double)c->event[i] * c->time_enabled / c->time_running[i]);
+}
+
+static void print_header(const struct pmu_event_config *config)
+{
+    const char *name;
+    unsigned int i;
+
+    printf("time_ns,cpu,interval_ns,cycles");
+    for (i = 0; i < config->nr_events; i++) {
+        name = pmu_event_name(config->event[i]);
+        if (name)
+            printf(",%s", name);
+        else
+            printf(",event_0x%02x", config->event[i]);
+    }
+    printf(",ipc,lost\n");
+}
+
+static void print_row(const struct pmu_event_config *config,
+                      const struct pmu_interval *rec)
+{
+    const struct pmu_counts *c = &rec->delta;
+    __u64 instructions = 0;
+    unsigned int i;
+
+    printf("%llu,%u,%llu,%llu", rec->time_ns, rec->cpu, c->time_enabled,
+           c->cycles);
+    for (i = 0; i < rec->nr_events && i < config->nr_events; i++) {
+        printf(",%llu", scaled(c, i));
+        if (config->event[i] == EVT_INSTR_RETIRED)
+            instructions = scaled(c, i);
+    }
+    if (c->cycles)
+        printf(",%.3f", (double)instructions / c->cycles);
+    else
+        printf(",");
+    printf(",%llu\n", rec->lost);
+}
+
+int main(int argc, char **argv)
+{
+    struct pmu_interval batch[BATCH];
+    struct pmu_snapshot snap;
+    struct sigaction sa;
+    struct pmu *pmu;
+    unsigned long us = 1000, duration = 0;
+    int opt, n, i, ret = 1;
+
+    while ((opt = getopt(argc, argv, "i:d:")) != -1) {
+        switch (opt) {
+        case 'i': us = strtoul(optarg, NULL, 0); break;
+        case 'd': duration = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-i us] [-d seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    pmu = pmu_open();
+    if (!pmu) {
+        perror("pmu_open");
+        return 1;
+    }
+
+    /* no SA_RESTART, so a signal interrupts the blocking read */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+    if (duration)
+        alarm(duration);
+
+    if (pmu_interval_start(pmu, us) < 0) {
+        perror("pmu_interval_start");
+        goto out;
+    }
+    if (pmu_snapshot(pmu, &snap) < 0) {
+        perror("pmu_snapshot");
+        goto stop;
+    }
+
+    print_header(&snap.config);
+    while (!done) {
+        n = pmu_interval_read(pmu, batch, BATCH);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            goto stop;
+        }
+        if (!n)
+            break;
+        for (i = 0; i < n; i++)
+            print_row(&snap.config, &batch[i]);
+    }
+    fflush(stdout);
+    ret = 0;
+
+stop:
+    pmu_interval_stop(pmu);
+out:
+    pmu_close(pmu);
+    return ret;
+}
@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "libpmu.h"
+
+/*
+ * Hot-PC profile from the module's sample rings.
+ *
+ *   pmu_top [-e event] [-p period] [-n top] [-i ms] [-d seconds] [cmd args...]
+ *
+ * With a command it is run under per-process counting and profiled until
+ * it exits, otherwise the whole machine is profiled for -d seconds.
+ * Resolve user PCs with addr2line -e <binary>.
+ */
+
+#define HIST_BITS  16
+#define HIST_SIZE  (1U << HIST_BITS)
+#define BATCH      256
+
+struct hist_entry {
+    __u64 pc;
+    __u64 count;
+    __u32 tgid;
+    __u32 user;
+};
+
+static struct hist_entry hist[HIST_SIZE];
+static __u64 nr_samples, nr_dropped;
+
+static void hist_add(const struct pmu_sample *s)
+{
+    __u32 h = (__u32)((s->pc * 0x9e3779b97f4a7c15ULL) >> (64 - HIST_BITS));
+    __u32 probe;
+
+    nr_samples++;
+    for (probe = 0; probe < HIST_SIZE; probe++) {
+        struct hist_entry *e = &hist[(h + probe) & (HIST_SIZE - 1)];
+
+        if (!e->count) {
+            e->pc = s->pc;
+            e->tgid = s->tgid;
+            e->user = s->user;
+        }
+        if (e->pc == s->pc) {
+            e->count++;
+            return;
+        }
+    }
+    nr_dropped++;
+}
+
+static int cmp_count(const void *a, const void *b)
+{
+    const struct hist_entry *x = a, *y = b;
+
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return 0;
+}
+
+static void drain(struct pmu_ring **rings, int nr_rings)
+{
+    struct pmu_sample batch[BATCH];
+    int cpu, n, i;
+
+    for (cpu = 0; cpu < nr_rings; cpu++) {
+        if (!rings[cpu])
+            continue;
+        while ((n = pmu_ring_read(rings[cpu], batch, BATCH)) > 0) {
+            for (i = 0; i < n; i++)
+                hist_add(&batch[i]);
+        }
+    }
+}
+
+static void print_top(struct pmu_ring **rings, int nr_rings, unsigned int top)
+{
+    __u64 lost = 0;
+    unsigned int i;
+    int cpu;
+
+    for (cpu = 0; cpu < nr_rings; cpu++) {
+        if (rings[cpu])
+            lost += pmu_ring_lost(rings[cpu]);
+    }
+
+    qsort(hist, HIST_SIZE, sizeof(hist[0]), cmp_count);
+
+    printf("samples: %llu, lost: %llu, unbinned: %llu\n",
+           nr_samples, lost, nr_dropped);
+    printf("%8s %7s %7s  %-18s %s\n", "count", "share", "tgid", "pc", "mode");
+    for (i = 0; i < top && i < HIST_SIZE && hist[i].count; i++) {
+        printf("%8llu %6.2f%% %7u  0x%016llx %s\n",
+               hist[i].count, 100.0 * hist[i].count / nr_samples,
+               hist[i].tgid, hist[i].pc, hist[i].user ? "user" : "kernel");
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-e event] [-p period] [-n top] [-i ms] [-d seconds] [cmd args...]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct pmu_ring **rings = NULL;
+    struct pmu *pmu = NULL;
+    struct timespec tick;
+    const char *event_name = "llc_misses";
+    unsigned long period = 10000, interval_ms = 100, duration = 5;
+    unsigned int top = 20;
+    int nr_rings = 0, event, cpu, opt, status;
+    int go[2] = { -1, -1 };
+    pid_t child = 0;
+    int targeted = 0;
+    long elapsed_ms = 0;
+    int ret = 1;
+
+    while ((opt = getopt(argc, argv, "+e:p:n:i:d:")) != -1) {
+        switch (opt) {
+        case 'e': event_name = optarg; break;
+        case 'p': period = strtoul(optarg, NULL, 0); break;
+        case 'n': top = strtoul(optarg, NULL, 0); break;
+        case 'i': interval_ms = strtoul(optarg, NULL, 0); break;
+        case 'd': duration = strtoul(optarg, NULL, 0); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    event = pmu_event_code(event_name);
+    if (event < 0)
+        event = strtol(event_name, NULL, 0);
+    if (!period || !interval_ms)
+        usage(argv[0]);
+
+    pmu = pmu_open();
+    if (!pmu) {
+        perror("pmu_open");
+        return 1;
+    }
+
+    /* the child waits on the pipe until it is the counting target */
+    if (optind < argc) {
+        if (pipe(go) < 0) {
+            perror("pipe");
+            goto out;
+        }
+        child = fork();
+        if (child < 0) {
+            perror("fork");
+            goto out;
+        }
+        if (!child) {
+            char c;
+
+            close(go[1]);
+            if (read(go[0], &c, 1) != 1)
+                _exit(127);
+            execvp(argv[optind], &argv[optind]);
+            perror("execvp");
+            _exit(127);
+        }
+        close(go[0]);
+        if (pmu_set_target(pmu, child, PMU_TARGET_CHILDREN) < 0) {
+            perror("pmu_set_target");
+            goto out;
+        }
+        targeted = 1;
+    }
+
+    if (pmu_sample_start(pmu, event, period) < 0) {
+        perror("pmu_sample_start");
+        goto out;
+    }
+
+    nr_rings = pmu_nr_rings(pmu);
+    rings = calloc(nr_rings, sizeof(*rings));
+    if (!rings)
+        goto stop;
+    for (cpu = 0; cpu < nr_rings; cpu++)
+        rings[cpu] = pmu_ring_map(pmu, cpu);
+
+    /* start from an empty ring, older samples belong to someone else */
+    drain(rings, nr_rings);
+    memset(hist, 0, sizeof(hist));
+    nr_samples = nr_dropped = 0;
+
+    if (child) {
+        if (write(go[1], "g", 1) != 1) {
+            perror("write");
+            goto stop;
+        }
+        close(go[1]);
+        go[1] = -1;
+    }
+
+    tick.tv_sec = interval_ms / 1000;
+    tick.tv_nsec = (interval_ms % 1000) * 1000000L;
+    for (;;) {
+        nanosleep(&tick, NULL);
+        drain(rings, nr_rings);
+        elapsed_ms += interval_ms;
+
+        if (child) {
+            if (waitpid(child, &status, WNOHANG) == child) {
+                child = 0;
+                break;
+            }
+        } else if (elapsed_ms >= (long)duration * 1000) {
+            break;
+        }
+    }
+    drain(rings, nr_rings);
+
+    print_top(rings, nr_rings, top);
+    ret = 0;
+
+stop:
+    for (cpu = 0; cpu < nr_rings && rings; cpu++)
+        pmu_ring_unmap(rings[cpu]);
+    free(rings);
+    pmu_sample_stop(pmu);
+out:
+    if (go[1] >= 0)
+        close(go[1]);
+    if (child > 0) {
+        kill(child, SIGKILL);
+        waitpid(child, NULL, 0);
+    }
+    if (targeted)
+        pmu_set_target(pmu, 0, 0);
+    pmu_close(pmu);
+    return ret;
+}